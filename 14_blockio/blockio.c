@@ -4,6 +4,7 @@
 #include <linux/ide.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/errno.h>
 #include <linux/gpio.h>
 #include <linux/cdev.h>
@@ -11,10 +12,20 @@
 #include <linux/of.h>
 #include <linux/of_address.h>
 #include <linux/of_gpio.h>
+#include <linux/platform_device.h>
+#include <linux/pm_wakeup.h>
 #include <linux/semaphore.h>
 #include <linux/timer.h>
 #include <linux/of_irq.h>
 #include <linux/irq.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/bitmap.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
 #include <asm/mach/map.h>
 #include <asm/uaccess.h>
 #include <asm/io.h>
@@ -26,15 +37,35 @@
 #define KEY0VALUE 	0xF0				/* 按键，被按下的按键值 */
 #define KEY0ONE     0xE0                /* 按键被一次按下 */
 #define INVAKEY 	0x00				/* 无效按键值，按键没被按下 */
-#define KEY_NUM     1                   /* 按键数量 	*/
+#define KEY_NUM_MAX		64					/* 最多支持的按键数量，矩阵键盘为行数x列数 */
+#define KEY_ROW_MAX		8					/* 矩阵键盘最多的行数 */
+#define KEY_COL_MAX		8					/* 矩阵键盘最多的列数 */
+#define KEY_SCAN_DELAY_US	5				/* 矩阵扫描时拉低行线后等待电平稳定的时间 */
+
+#define KEY_RING_SIZE	64					/* 按键事件广播缓冲区的大小，必须是2的幂 */
+#define KEY_EVENT_WAKEUP	0x01				/* key_event.flags：这个按键唤醒了系统 */
+#define KEY_READ_BATCH	16					/* read时每次从缓冲区取出的事件数 */
+
+/* 按键事件，按下和释放各产生一个，read一次可以读出多个 */
+struct key_event {
+	unsigned long long timestamp;	/* 按键边沿的时间，在硬件中断中用ktime_get_ns记录，单位ns */
+	unsigned char key;				/* 按键编号 */
+	unsigned char value;			/* KEY0ONE：按下，KEY0VALUE：按下后释放 */
+	unsigned char flags;			/* KEY_EVENT_WAKEUP等标志 */
+	unsigned char reserved;
+	unsigned int dropped;			/* 这个读者到目前为止因为读得太慢丢失的事件总数 */
+};
 
-/* 中断IO描述结构体 */
+/* 按键描述结构体，独立按键每个按键一个，矩阵键盘每一列一个(列线产生中断) */
 struct irq_keydesc{
 	int gpio_key;   /* gpio编号 */
 	int irqnum;   /* 中断号     */
-	unsigned char value;  /* 按键对应的键值 */
 	char name[10];   /* 中断名字 */
-	irqreturn_t (*handler) (int, void *);    /* 中断服务函数 */
+	struct list_head node;	/* 挂在消抖链表上，不在链表上时指向自己 */
+	ktime_t deadline;		/* 消抖结束的时间 */
+	u64 hwstamp;	/* 硬件中断中记录的边沿时间，由中断线程取走 */
+	u64 edge;		/* 这次消抖的第一个边沿时间，扫描后清零，由lock保护 */
+	bool wakeup;	/* 这个按键的中断唤醒了系统 */
 };
 
 /* timer设备结构体 */
@@ -45,160 +76,449 @@ struct imx6ulirq_dev{
 	struct device *device;	/* 设备 */
 	int major;   /* 主设备号 */
 	int minor;   /* 次设备号 */
+	struct device *parent;	/* platform设备，用于唤醒统计 */
+	bool suspended;	/* 系统休眠中，这时的按键中断就是唤醒原因 */
 	struct device_node *nd;   /* 设备都是以节点的形式“挂”到设备树上的，因此要想获取这个设备的其他属性信息，必须先获取到这个设备的节点。
 							 Linux内核使用device_node结构体来描述一个节点 */ 
 
-	int timerperiod;   /* 定时周期，单位为ms，系统频率为100 Hz */
-	struct timer_list timer;  /* 定义一个定时器 */
+	struct hrtimer timer;  /* 所有按键共用一个消抖定时器，到期时间为消抖链表中最早的到期时间 */
+	spinlock_t lock;	/* 保护消抖链表和事件缓冲区 */
+	struct list_head pending;	/* 正在消抖的按键，按到期时间排序，定时器只处理这些按键 */
 
-	struct irq_keydesc irqkeydesc[KEY_NUM]; /* 按键描述结构体数组,开发板上只有一个按键，因此irqkeydesc数组只有一个元素*/  
+	struct irq_keydesc irqkeydesc[KEY_NUM_MAX]; /* 按键描述结构体数组，矩阵键盘时为每一列 */
+	int nkeys;	/* irqkeydesc的数量 */
+	int row_gpios[KEY_ROW_MAX];	/* 矩阵键盘的行线 */
+	int nrows;	/* 行数，0表示独立按键 */
+	int ncols;	/* 列数，独立按键时等于按键数量 */
+	DECLARE_BITMAP(keystate, KEY_NUM_MAX);	/* 每个按键上次上报的状态，1为按下 */
 
-	atomic_t keyvalue;		/* 有效的按键键值 */
-	atomic_t releasekey;	/* 表示按键是否被释放，如果按键被释放表示发生了一次完整的按键过程，包括按下和释放 */
+	struct key_event events[KEY_RING_SIZE];	/* 按键事件广播缓冲区，定时器中写入，所有读者共享，满了覆盖最旧的事件 */
+	unsigned int head;	/* 写入过的事件总数，由lock保护，回绕后按无符号差计算 */
 
-	unsigned char curkeynum;	/* 当前的按键号 */
 
-	wait_queue_head_t key_rwait;  /* 定义读等待队列头 */
+	struct list_head readers;	/* 所有打开的读者，由lock保护 */
 	
 };
 
 struct imx6ulirq_dev imx6ulirq;
 
+/* 读者结构体，每次打开分配一个，各自有读位置，所有读者都能读到每一个按键事件 */
+struct key_reader{
+	struct imx6ulirq_dev *dev;	/* 设备 */
+	unsigned int tail;	/* 下一个要读的事件序号 */
+	unsigned int dropped;	/* 丢失的事件总数 */
+	wait_queue_head_t wait;	/* 这个读者的等待队列，只在它有新事件时唤醒 */
+	struct list_head node;	/* 挂在设备的readers链表上 */
+};
+
+/* 消抖时间，单位us，所有按键共用，链表按到期时间排序依赖于它在运行时不变 */
+static unsigned int debounce_us = 5000;
+module_param(debounce_us, uint, 0444);
+MODULE_PARM_DESC(debounce_us, "Key debounce window in microseconds");
+
+/* 前沿消抖：第一个边沿立即上报，之后debounce_us内忽略抖动，窗口结束时再确认一次电平。
+ * 默认为后沿消抖：最后一个边沿之后稳定debounce_us才上报 */
+static bool debounce_leading;
+module_param(debounce_leading, bool, 0444);
+MODULE_PARM_DESC(debounce_leading, "Report on the first edge and ignore bounces for debounce_us");
+
+/*
+ * @description		: 计算消抖窗口结束的时间，窗口至少1us，
+ *					  保证定时器中重新加入链表的按键不会在同一次处理中到期
+ * @return 			: 到期时间
+ */
+static ktime_t key_deadline(void)
+{
+	return ktime_add_us(ktime_get(),debounce_us ? debounce_us : 1);
+}
+
+
+/*
+ * @description		: 上报一个按键事件，写入广播缓冲区，调用者持有lock
+ * @param - dev 	: 设备
+ * @param - key 	: 按键编号
+ * @param - pressed : 1 按下;0 松开
+ * @param - ts 		: 边沿的时间
+ * @return 			: 无
+ */
+static void key_report(struct imx6ulirq_dev *dev,int key,int pressed,u64 ts)
+{
+	struct key_event *event=&dev->events[dev->head & (KEY_RING_SIZE-1)];
+
+	event->timestamp=ts;
+	event->key=key;
+	event->value=pressed ? KEY0ONE : KEY0VALUE;   /* KEY0VALUE表示按键值被按下与释放 */
+	event->flags=0;
+	event->dropped=0;
+	dev->head++;   /* 缓冲区满时覆盖最旧的事件，读得慢的读者在读取时发现溢出 */
+}
+
+/*
+ * @description		: 一批按键事件上报完成，唤醒等待的进程
+ * @param - dev 	: 设备
+ * @return 			: 无
+ */
+static void key_report_sync(struct imx6ulirq_dev *dev)
+{
+	struct key_reader *reader;
+
+	/* 逐个唤醒读者，带上POLLIN作为key，epoll只唤醒关心可读事件的等待者；
+	 * 同一个文件上的多个读进程是互斥等待，每次只唤醒一个 */
+	list_for_each_entry(reader,&dev->readers,node){
+		wake_up_interruptible_poll(&reader->wait,POLLIN|POLLRDNORM);
+	}
+}
+
+/*
+ * @description		: 比较按键的新状态和上次上报的状态，变化时上报
+ * @param - dev 	: 设备
+ * @param - key 	: 按键编号，矩阵键盘为 行号x列数+列号
+ * @param - pressed : 1 按下;0 松开
+ * @param - ts 		: 边沿的时间
+ * @return 			: 1 状态变化;0 没有变化
+ */
+static int key_update(struct imx6ulirq_dev *dev,int key,int pressed,u64 ts)
+{
+	if(pressed==test_bit(key,dev->keystate)){
+		return 0;
+	}
+	__change_bit(key,dev->keystate);
+	key_report(dev,key,pressed,ts);
+	return 1;
+}
+
+/*
+ * @description		: 消抖结束后读取按键状态，矩阵键盘逐行扫描这一列
+ * @param - dev 	: 设备
+ * @param - keydesc : 按键描述结构体
+ * @return 			: 状态变化的按键数量
+ */
+static int key_scan(struct imx6ulirq_dev *dev,struct irq_keydesc *keydesc)
+{
+	int col=keydesc-dev->irqkeydesc;
+	int r,pressed,changed=0;
+	u64 ts=keydesc->edge ? keydesc->edge : ktime_get_ns();   /* 上报的时间为这次抖动的第一个边沿 */
+
+	keydesc->edge=0;
+	if(dev->nrows==0){   /* 独立按键，低电平表示按下 */
+		return key_update(dev,col,gpio_get_value(keydesc->gpio_key)==0,ts);
+	}
+
+	/* 矩阵键盘：先释放所有行线，再逐行拉低，读取这一列。
+	 * 按下的按键在扫描时会在列线上产生边沿，按住不放时每个消抖周期会重新扫描一次，状态不变不会上报 */
+	for(r=0;r<dev->nrows;r++){
+		gpio_direction_input(dev->row_gpios[r]);
+	}
+	for(r=0;r<dev->nrows;r++){
+		gpio_direction_output(dev->row_gpios[r],0);
+		udelay(KEY_SCAN_DELAY_US);
+		pressed=gpio_get_value(keydesc->gpio_key)==0;
+		gpio_direction_input(dev->row_gpios[r]);
+		changed+=key_update(dev,r*dev->ncols+col,pressed,ts);
+	}
+	/* 所有行线恢复为低电平，任何按键按下都会在列线上产生中断 */
+	for(r=0;r<dev->nrows;r++){
+		gpio_direction_output(dev->row_gpios[r],0);
+	}
+	return changed;
+}
+
+/*
+ * @description		: 按键唤醒了系统。休眠期间的按键可能在消抖完成之前就已经松开，
+ *					  独立按键直接上报一次按下，之后的消抖会在松开时上报释放；
+ *					  矩阵键盘不知道是哪一行，立即扫描一次这一列。调用者持有lock
+ * @param - dev 	: 设备
+ * @param - keydesc : 唤醒系统的按键
+ * @return 			: 无
+ */
+static void key_wakeup(struct imx6ulirq_dev *dev,struct irq_keydesc *keydesc)
+{
+	int key=keydesc-dev->irqkeydesc;
+
+	printk("wakeup by %s\r\n",keydesc->name);
+	if(dev->nrows){
+		if(key_scan(dev,keydesc)){
+			key_report_sync(dev);
+		}
+		return;
+	}
+	if(test_bit(key,dev->keystate)){   /* 休眠之前就是按下状态 */
+		return;
+	}
+	__set_bit(key,dev->keystate);
+	key_report(dev,key,1,keydesc->edge ? keydesc->edge : ktime_get_ns());
+	dev->events[(dev->head-1) & (KEY_RING_SIZE-1)].flags=KEY_EVENT_WAKEUP;   /* 标记为唤醒系统的事件 */
+	keydesc->edge=0;   /* 边沿已经用于这次按下，消抖窗口内松开时使用松开时的时间 */
+	key_report_sync(dev);
+}
+
+/* @description		: 硬件中断服务函数，只记录边沿的时间，其他工作在中断线程中完成。
+ *				  	  使用IRQF_ONESHOT，中断线程执行完之前这个中断一直屏蔽，不会覆盖没取走的时间
+ * @param - irq 	: 中断号 
+ * @param - dev_id	: 按键描述结构体
+ * @return 			: 唤醒中断线程
+ */
+static irqreturn_t key_hardirq(int irq, void *dev_id)
+{
+	struct irq_keydesc *keydesc=dev_id;
+
+	keydesc->hwstamp=ktime_get_ns();
+	if(imx6ulirq.suspended){   /* 休眠时产生的中断，记录唤醒原因 */
+		keydesc->wakeup=true;
+		pm_wakeup_event(imx6ulirq.parent,0);   /* 计入/sys/kernel/debug/wakeup_sources */
+	}
+	return IRQ_WAKE_THREAD;
+}
 
-/* @description		: 中断服务函数，开启定时器，延时10ms，
- *				  	  定时器用于按键消抖。
+/* @description		: 中断线程，把按键加入消抖链表。所有按键共用一个hrtimer，
+ *				  	  后沿消抖时，窗口内再次产生的中断只会推迟这个按键的到期时间；
+ *				  	  前沿消抖时，第一个边沿直接上报，窗口内的中断被忽略。
  * @param - irq 	: 中断号 
- * @param - dev_id	: 设备结构。
+ * @param - dev_id	: 按键描述结构体
  * @return 			: 中断执行结果
  */
-static irqreturn_t key0_handler(int irq, void *dev_id)
+static irqreturn_t key_handler(int irq, void *dev_id)
 {	
-	struct imx6ulirq_dev *dev=(struct imx6ulirq_dev *)dev_id;
-	dev->curkeynum=0;
-	/* 开启定时器 */
-	dev->timer.data=(unsigned long)dev;  /* 设置要传递给function函数的参数 */
-	mod_timer(&dev->timer,jiffies+msecs_to_jiffies(dev->timerperiod));
+	struct irq_keydesc *keydesc=dev_id;
+	struct imx6ulirq_dev *dev=&imx6ulirq;
+	unsigned long flags;
+	bool empty;
+
+	spin_lock_irqsave(&dev->lock,flags);
+	if(!keydesc->edge){   /* 记录这次抖动的第一个边沿 */
+		keydesc->edge=keydesc->hwstamp;
+	}
+	if(keydesc->wakeup){
+		keydesc->wakeup=false;
+		key_wakeup(dev,keydesc);
+	}
+	if(debounce_leading){
+		if(!list_empty(&keydesc->node)){   /* 还在消抖窗口内，是抖动，忽略 */
+			spin_unlock_irqrestore(&dev->lock,flags);
+			return IRQ_RETVAL(IRQ_HANDLED);
+		}
+		/* 第一个边沿，立即读取电平并上报，不等待消抖 */
+		if(key_scan(dev,keydesc)){
+			key_report_sync(dev);
+		}
+	}
+	empty=list_empty(&dev->pending);
+	keydesc->deadline=key_deadline();
+	/* 消抖时间都一样，新的到期时间总是最晚的，放到链表尾部，链表始终按到期时间排序 */
+	list_move_tail(&keydesc->node,&dev->pending);
+	if(empty){   /* 链表原来为空，定时器没有运行 */
+		hrtimer_start(&dev->timer,keydesc->deadline,HRTIMER_MODE_ABS);
+	}
+	spin_unlock_irqrestore(&dev->lock,flags);
 
 	return IRQ_RETVAL(IRQ_HANDLED);
 	
 }
 
-
-/* static一般用于修饰局部变量，全局变量，函数 */
-
-/* @description	: 定时器服务函数，用于按键消抖，定时器到了以后
- *				  再次读取按键值，如果按键还是处于按下状态就表示按键有效。
- * @param - arg	: 设备结构变量
- * @return 		: 无
+/* @description	: 定时器服务函数，处理消抖链表中所有已经到期的按键，
+ *				  只访问正在消抖的按键，按键再多也只有一个定时器。
+ * @param - timer	: 定时器
+ * @return 		: 是否重新启动定时器
  */
-void timer_function(unsigned long arg)
+static enum hrtimer_restart key_timer_function(struct hrtimer *timer)
 {
-	struct imx6ulirq_dev *dev=(struct imx6ulirq_dev *)arg;
-	unsigned char num;
+	struct imx6ulirq_dev *dev=container_of(timer,struct imx6ulirq_dev,timer);
 	struct irq_keydesc *keydesc;
+	enum hrtimer_restart ret=HRTIMER_NORESTART;
+	ktime_t now=ktime_get();
+	unsigned long flags;
+	int changed=0;
+
+	spin_lock_irqsave(&dev->lock,flags);
+	while(!list_empty(&dev->pending)){
+		keydesc=list_first_entry(&dev->pending,struct irq_keydesc,node);
+		if(ktime_after(keydesc->deadline,now)){   /* 后面的按键都还没到期 */
+			break;
+		}
+		list_del_init(&keydesc->node);
+		if(key_scan(dev,keydesc)){
+			changed++;
+			if(debounce_leading){   /* 窗口内电平又变了，上报后重新开始一个消抖窗口 */
+				keydesc->deadline=key_deadline();
+				list_add_tail(&keydesc->node,&dev->pending);
+			}
+		}
+	}
+	if(changed){   /* 一批按键处理完后统一通知 */
+		key_report_sync(dev);
+	}
+	if(!list_empty(&dev->pending)){   /* 定时到下一个按键的到期时间 */
+		keydesc=list_first_entry(&dev->pending,struct irq_keydesc,node);
+		hrtimer_set_expires(timer,keydesc->deadline);
+		ret=HRTIMER_RESTART;
+	}
+	spin_unlock_irqrestore(&dev->lock,flags);
 
-	num=dev->curkeynum;
-	keydesc=&dev->irqkeydesc[num];
+	return ret;
+}
 
-	if(gpio_get_value(keydesc->gpio_key)==0){  /* 10ms定时器内按键被按下 */
-		atomic_set(&dev->keyvalue,KEY0ONE);
-	}else{
-		atomic_set(&dev->keyvalue,KEY0VALUE);   /* 表示按键值被按下与释放 */
-		atomic_set(&dev->releasekey,1);   /* 表示一次有效的按键释放 */
-	}
+/*
+ * @description : devm释放动作，删除消抖定时器。devm按申请的相反顺序释放资源，
+ *				  这个动作在申请中断之前注册，所以执行时中断已经释放，定时器不会再被启动
+ * @param - data : 设备
+ * @return : 无
+ */
+static void keyio_timer_cancel(void *data)
+{
+	struct imx6ulirq_dev *dev=data;
 
-	/* 唤醒进程(等待队列)，在合适的点唤醒等待队列，一般都是中断处理函数里面  */
-	if(atomic_read(&dev->releasekey)){  /* 完成一次按键过程 */
-		wake_up_interruptible(&dev->key_rwait);
-	}
+	hrtimer_cancel(&dev->timer);
 }
 
  /*
-  * @description : 初始化按键 IO， open 函数打开驱动的时候
-  *  初始化按键所使用的 GPIO 引脚。
-  *  @param : 无
-  *  @return : 无
+  * @description : 初始化按键 IO，按键数量由设备树决定：
+  *  有row-gpios和col-gpios时为矩阵键盘，否则为key-gpios中的独立按键。
+  *  GPIO和中断都用devm接口申请，probe失败或者驱动移除时自动释放
+  *  @param - pdev : platform设备
+  *  @return : 0 成功;其他 失败
  */
-static int keyio_init(void)
+static int keyio_init(struct platform_device *pdev)
 {
+	struct imx6ulirq_dev *dev=&imx6ulirq;
+	struct irq_keydesc *keydesc;
+	const char *prop="key-gpios";
 	int ret=0;
-	unsigned char i=0;
+	int i,gpio,irq,nrows,ncols;
 
-	/* 设置key所使用的GPIO */
-	/* 1、获取设备节点：key */
-	imx6ulirq.nd=of_find_node_by_path("/key"); /* 通过路径来查找指定的节点，path：带有全路径的节点名，可以使用节点的别名 */
-	if(imx6ulirq.nd==NULL){
+	/* 1、获取设备节点，就是和驱动匹配的节点 */
+	dev->parent=&pdev->dev;
+	dev->nd=pdev->dev.of_node;
+	if(dev->nd==NULL){
 		printk("key node not find!\r\n");
 		return -EINVAL;  /* 返回无效参数符号 */
-	}else{
-		printk("key node find!\r\n");
 	}
 
-	/* 2、获取设备树中的gpio属性，得到key所使用的key编号*/
-	for(i=0;i<KEY_NUM;i++){
-		imx6ulirq.irqkeydesc[i].gpio_key=of_get_named_gpio(imx6ulirq.nd,"key-gpios",i); 
-		 /* 类似<&gpio5 7 GPIO_ACTIVE_LOW>的属性信息转换为对应的GPIO编号 */
-	/* 函数原型：int of_get_named_gpio(struct device_node *np,const char *propname,int index) */
-		if(imx6ulirq.irqkeydesc[i].gpio_key<0){
-			printk("can't get key-gpios!\r\n");
-			return -EINVAL;  /* 返回无效参数符号 */
-		}else{
-			printk("key%d-gpios num=%d\r\n",i,imx6ulirq.irqkeydesc[i].gpio_key);
-		}
+	/* 2、初始化消抖定时器和链表 */
+	spin_lock_init(&dev->lock);
+	INIT_LIST_HEAD(&dev->pending);
+	hrtimer_init(&dev->timer,CLOCK_MONOTONIC,HRTIMER_MODE_ABS);
+	dev->timer.function=key_timer_function;
+	bitmap_zero(dev->keystate,KEY_NUM_MAX);
+	ret=devm_add_action(&pdev->dev,keyio_timer_cancel,dev);
+	if(ret<0){
+		return ret;
 	}
 
-	/* 3、始化key所使用的IO，并且设置成中断模式 */
-	for(i=0;i<KEY_NUM;i++){
-		memset(imx6ulirq.irqkeydesc[i].name,0,sizeof(imx6ulirq.irqkeydesc[i].name));   /* memset一般使用“0”初始化内存单元,而且通常是给数组或结构体进行初始化 */
-		sprintf(imx6ulirq.irqkeydesc[i].name,"KEY%d",i);
-
-		/* 申请IO，申请后能被其他设备检测，避免重复使用 */
-		ret=gpio_request(imx6ulirq.irqkeydesc[i].gpio_key,imx6ulirq.irqkeydesc[i].name);
-		/* 函数原型： int gpio_request(unsigned gpio, const char *label)*/
-		if(ret<0){
-			printk("key%d io request fail!\r\n",i);
-			return -EINVAL;  /* 返回无效参数符号 */
+	/* 3、获取按键数量 */
+	nrows=of_gpio_named_count(dev->nd,"row-gpios");
+	ncols=of_gpio_named_count(dev->nd,"col-gpios");
+	if(nrows>0 && ncols>0){   /* 矩阵键盘 */
+		if(nrows>KEY_ROW_MAX || ncols>KEY_COL_MAX){
+			printk("key matrix %dx%d too large!\r\n",nrows,ncols);
+			return -EINVAL;
 		}
-		/* 设置key gpio为输入 */
-		ret=gpio_direction_input(imx6ulirq.irqkeydesc[i].gpio_key);
-		/* 函数原型：int gpio_direction_input(unsigned gpio, int value) */
-		if(ret<0){
-			printk("can't set key%d gpio!\r\n",i);
-			return -EINVAL;  /* 返回无效参数符号 */
+		prop="col-gpios";
+	}else{   /* 独立按键，看作只有一行的矩阵 */
+		nrows=0;
+		ncols=of_gpio_named_count(dev->nd,"key-gpios");
+		if(ncols<=0 || ncols>KEY_NUM_MAX){
+			printk("can't get key-gpios!\r\n");
+			return -EINVAL;
 		}
-		/* 获取中断号 */
-		imx6ulirq.irqkeydesc[i].irqnum=irq_of_parse_and_map(imx6ulirq.nd,i);
-
-		printk("key%d:gpio=%d, irqnum=%d\r\n",i,imx6ulirq.irqkeydesc[i].gpio_key,imx6ulirq.irqkeydesc[i].irqnum);
+	}
+	dev->nrows=nrows;
+	dev->ncols=ncols;
+	dev->nkeys=ncols;
+
+	/* 4、矩阵键盘的行线设置为输出低电平 */
+	for(i=0;i<nrows;i++){
+		gpio=of_get_named_gpio(dev->nd,"row-gpios",i);
+		if(gpio<0 || devm_gpio_request_one(&pdev->dev,gpio,GPIOF_OUT_INIT_LOW,"keyrow")<0){
+			printk("key row%d io request fail!\r\n",i);
+			return -EINVAL;
+		}
+		dev->row_gpios[i]=gpio;
 	}
 
-	/* 申请中断 */
-	imx6ulirq.irqkeydesc[0].handler=key0_handler;
-	imx6ulirq.irqkeydesc[0].value = KEY0VALUE;
-	
+	/* 5、初始化按键(列)所使用的IO，并且设置成中断模式 */
+	for(i=0;i<ncols;i++){
+		keydesc=&dev->irqkeydesc[i];
+		INIT_LIST_HEAD(&keydesc->node);
+		keydesc->hwstamp=0;
+		keydesc->edge=0;
+		keydesc->wakeup=false;
+		memset(keydesc->name,0,sizeof(keydesc->name));   /* memset一般使用“0”初始化内存单元,而且通常是给数组或结构体进行初始化 */
+		sprintf(keydesc->name,"KEY%d",i);
+
+		/* 类似<&gpio5 7 GPIO_ACTIVE_LOW>的属性信息转换为对应的GPIO编号 */
+		gpio=of_get_named_gpio(dev->nd,prop,i);
+		if(gpio<0){
+			printk("can't get %s %d!\r\n",prop,i);
+			return -EINVAL;
+		}
+		/* 申请IO并设置为输入，申请后能被其他设备检测，避免重复使用 */
+		if(devm_gpio_request_one(&pdev->dev,gpio,GPIOF_IN,keydesc->name)<0){
+			printk("key%d io request fail!\r\n",i);
+			return -EINVAL;
+		}
+		keydesc->gpio_key=gpio;
 
-	for(i=0;i<KEY_NUM;i++){
-		ret=request_irq(imx6ulirq.irqkeydesc[i].irqnum,imx6ulirq.irqkeydesc[i].handler, IRQF_TRIGGER_RISING|IRQF_TRIGGER_FALLING,
-						imx6ulirq.irqkeydesc[i].name,&imx6ulirq);
+		/* 获取中断号，按键数量不固定，直接由GPIO得到中断号 */
+		irq=gpio_to_irq(gpio);
+		if(irq<0){
+			printk("key%d can't get irq!\r\n",i);
+			return irq;
+		}
+		/* 硬件中断只记录时间，消抖在中断线程中进行 */
+		ret=devm_request_threaded_irq(&pdev->dev,irq,key_hardirq,key_handler,
+									  IRQF_TRIGGER_RISING|IRQF_TRIGGER_FALLING|IRQF_ONESHOT,keydesc->name,keydesc);
 		if(ret<0){
-			printk("key%d irq-%d request failed!\r\n",i,imx6ulirq.irqkeydesc[i].irqnum);
-			return -EFAULT;
+			printk("key%d irq-%d request failed!\r\n",i,irq);
+			return ret;
 		}
+		keydesc->irqnum=irq;
+
+		printk("key%d:gpio=%d, irqnum=%d\r\n",i,keydesc->gpio_key,keydesc->irqnum);
 	}
 
-	/* 创建定时器 */
-	init_timer(&imx6ulirq.timer);
-	imx6ulirq.timer.function=timer_function;
-	imx6ulirq.timerperiod=10;        /* 定时周期为10ms */
+	printk("%d keys, %s\r\n",nrows ? nrows*ncols : ncols,nrows ? "matrix" : "direct");
+	return 0;
+}
 
-	/* 初始化按键 */
-	atomic_set(&imx6ulirq.keyvalue,INVAKEY);  /* 初始化按键没被按下 */
-	atomic_set(&imx6ulirq.releasekey,0);    /* 没有一次有效的按键释放 */
+/*
+ * @description		: 读者是否还有没读的事件
+ * @param - reader 	: 读者
+ * @return 			: true 有;false 没有
+ */
+static bool key_reader_pending(struct key_reader *reader)
+{
+	return ACCESS_ONCE(reader->dev->head)!=reader->tail;
+}
 
-	/* 初始化等待队列头 */
-	init_waitqueue_head(&imx6ulirq.key_rwait);
+/*
+ * @description		: 从广播缓冲区取出最多n个事件。读得太慢时最旧的事件已被覆盖，
+ *					  跳过这些事件并计入这个读者的丢失计数
+ * @param - reader 	: 读者
+ * @param - buf 	: 存放事件的缓冲区
+ * @param - n 		: 最多取出的事件数
+ * @return 			: 取出的事件数
+ */
+static unsigned int key_reader_fetch(struct key_reader *reader,struct key_event *buf,unsigned int n)
+{
+	struct imx6ulirq_dev *dev=reader->dev;
+	unsigned long flags;
+	unsigned int avail,i;
+
+	spin_lock_irqsave(&dev->lock,flags);
+	avail=dev->head-reader->tail;
+	if(avail>KEY_RING_SIZE){   /* 溢出 */
+		reader->dropped+=avail-KEY_RING_SIZE;
+		reader->tail=dev->head-KEY_RING_SIZE;
+		avail=KEY_RING_SIZE;
+	}
+	n=min(n,avail);
+	for(i=0;i<n;i++){
+		buf[i]=dev->events[reader->tail++ & (KEY_RING_SIZE-1)];
+		buf[i].dropped=reader->dropped;
+	}
+	spin_unlock_irqrestore(&dev->lock,flags);
 
-	return ret;
+	return n;
 }
 
 /*
@@ -210,13 +530,22 @@ static int keyio_init(void)
  */
 static int imx6ulirq_open(struct inode *inode, struct file *filp)
 {
-	int ret=0;
-	ret=keyio_init();   /* 初始化ledio */
-	if(ret<0){
-		return ret;
-	}
+	struct imx6ulirq_dev *dev=&imx6ulirq;
+	struct key_reader *reader;
 
-	filp->private_data=&imx6ulirq;
+	/* 按键在probe时已经初始化，每次打开只分配一个读者，从当前位置开始读 */
+	reader=kzalloc(sizeof(*reader),GFP_KERNEL);
+	if(!reader){
+		return -ENOMEM;
+	}
+	reader->dev=dev;
+	init_waitqueue_head(&reader->wait);
+	spin_lock_irq(&dev->lock);
+	reader->tail=dev->head;
+	list_add_tail(&reader->node,&dev->readers);
+	spin_unlock_irq(&dev->lock);
+
+	filp->private_data=reader;
 	return 0;
 }
 
@@ -230,47 +559,61 @@ static int imx6ulirq_open(struct inode *inode, struct file *filp)
  */
 static ssize_t imx6ulirq_read(struct file *filp, char __user *buf, size_t cnt, loff_t *offt)
 {
-	struct imx6ulirq_dev *dev=filp->private_data;
-	unsigned char keyvalue=0;
-	unsigned char releasekey=0;
+	struct key_reader *reader=filp->private_data;
+	struct key_event events[KEY_READ_BATCH];
+	unsigned int n,copied=0;
 	int ret=0;
 
 	/* 定义一个等待队列，整体简化为等待事件 wait_event(wq, condition) */
 	DECLARE_WAITQUEUE(rwait,current);   /* 第一参数就是等待队列项的名字，第二参数表示这个等待队列项属于哪个任务(进程)，一般设置为current， 
 											在Linux内核中current相当于一个全局变量，表示当前进程(按键) */
-	/* 没有按键按下，将等待队列加入等待队列头中 */
-	if(atomic_read(&dev->releasekey)==0){
-		add_wait_queue(&dev->key_rwait,&rwait);
-		__set_current_state(TASK_INTERRUPTIBLE);/* 设置任务状态，可以被信号打断 ??? */  
+
+	if(cnt<sizeof(struct key_event)){   /* 至少要能放下一个事件 */
+		return -EINVAL;
+	}
+
+retry:
+	/* 没有按键事件，将等待队列加入等待队列头中 */
+	add_wait_queue_exclusive(&reader->wait,&rwait);   /* 互斥等待，同一个文件上有多个读进程时只唤醒一个 */
+	while(1){
+		set_current_state(TASK_INTERRUPTIBLE);	/* 先设置任务状态再检查条件，避免检查之后到来的唤醒丢失 */
+		if(key_reader_pending(reader)){
+			break;
+		}
 		schedule();							/* 进行一次任务切换，当前进程就会进入休眠态，如果有按键按下，那么进入休眠态的进程就会唤醒，*/
 
-		/*然后接着从休眠点开始运行 */										
+		/*然后接着从休眠点开始运行 */
 		if(signal_pending(current))	{			/* 判断是否为信号引起的唤醒 */
 			ret = -ERESTARTSYS;
 			goto wait_error;
 		}
-		__set_current_state(TASK_RUNNING);      /* 不由信号唤醒即被按键唤醒，将当前任务设置为运行状态 */
-	    remove_wait_queue(&dev->key_rwait, &rwait);    /* 将对应的队列项从等待队列头删除 */
 	}
-
-	keyvalue=atomic_read(&dev->keyvalue);
-	releasekey=atomic_read(&dev->releasekey);
-
-	if(releasekey){   /* 按键被按下 */
-		if(keyvalue==KEY0VALUE){   /* 按键为按下和释放 */
-			ret=copy_to_user(buf,&keyvalue,sizeof(keyvalue));
-		}else{
-			return -EINVAL;
+	__set_current_state(TASK_RUNNING);      /* 不由信号唤醒即被按键唤醒，将当前任务设置为运行状态 */
+	remove_wait_queue(&reader->wait, &rwait);    /* 将对应的队列项从等待队列头删除 */
+
+	/* 分批从广播缓冲区取出事件，拷贝到用户空间时不能持有自旋锁 */
+	cnt/=sizeof(struct key_event);
+	while(copied<cnt){
+		n=key_reader_fetch(reader,events,min_t(size_t,cnt-copied,KEY_READ_BATCH));
+		if(n==0){
+			break;
 		}
-		atomic_set(&dev->releasekey,0);   /* 清除标志位 */
-	}else{
-		return -EINVAL;
+		if(copy_to_user(buf+copied*sizeof(struct key_event),events,n*sizeof(struct key_event))){
+			return copied ? copied*sizeof(struct key_event) : -EFAULT;
+		}
+		copied+=n;
 	}
-	return ret;
+	if(copied==0){   /* 多个进程读同一个文件，事件被其他进程先取走了，重新等待 */
+		goto retry;
+	}
+	if(key_reader_pending(reader)){   /* 缓冲区太小没有读完，唤醒下一个等待的进程 */
+		wake_up_interruptible_poll(&reader->wait,POLLIN|POLLRDNORM);
+	}
+	return copied*sizeof(struct key_event);
 
 wait_error:
 	set_current_state(TASK_RUNNING);		/* 设置任务为运行态 */
-	remove_wait_queue(&dev->key_rwait, &rwait);	/* 将等待队列移除 */
+	remove_wait_queue(&reader->wait, &rwait);	/* 将等待队列移除 */
 	return ret;
 }
 
@@ -281,16 +624,11 @@ wait_error:
  */
 static int imx6ulirq_release(struct inode *inode, struct file *filp)
 {
-	struct imx6ulirq_dev *dev=filp->private_data;
-	unsigned char i=0;
-	del_timer_sync(&dev->timer);	/* 删除timer定时期 */
-
-	/* 释放中断 */
-	for(i=0;i<KEY_NUM;i++){
-		free_irq(dev->irqkeydesc[i].irqnum,dev);  /* dev为指针参数，不需要取址符号& */
-		/* 释放IO,申请和释放配合使用 */
-		gpio_free(dev->irqkeydesc[i].gpio_key);
-	}
+	struct key_reader *reader=filp->private_data;
+	spin_lock_irq(&reader->dev->lock);
+	list_del(&reader->node);
+	spin_unlock_irq(&reader->dev->lock);
+	kfree(reader);   /* 释放读者 */
 	return 0;
 }
 
@@ -303,22 +641,42 @@ static struct file_operations imx6ulirq_fops={
 };
 
 
-/* 驱动入口 */
-static int __init imx6ulirq_init(void)
-{	
+/*
+ * @description		: platform驱动的probe函数，当驱动与设备匹配以后此函数就会执行，
+ *					  按键IO和中断只在这里初始化一次，open和release不再申请和释放资源
+ * @param - pdev 	: platform设备
+ * @return 			: 0，成功;其他负值,失败
+ */
+static int imx6ulirq_probe(struct platform_device *pdev)
+{
+	int ret=0;
+	printk("key driver and device has matched!\r\n");
+
+	/* 初始化读者链表，每个读者有自己的等待队列 */
+	INIT_LIST_HEAD(&imx6ulirq.readers);
+
+	/* 初始化按键IO和中断 */
+	ret=keyio_init(pdev);
+	if(ret<0){
+		return ret;
+	}
+
 	/* 注册字符设备驱动 */
 	/* 1、创建设备号 */
 	if(imx6ulirq.major){
-		imx6ulirq.devid=MKDEV(imx6ulirq.devid,0);  /* 由高12位的主设备号和低20位的次设备号组成完全设备号 */
-		register_chrdev_region(imx6ulirq.devid,IMX6ULIRQ_CNT,IMX6ULIRQ_NAME);
+		imx6ulirq.devid=MKDEV(imx6ulirq.major,0);  /* 由高12位的主设备号和低20位的次设备号组成完全设备号 */
+		ret=register_chrdev_region(imx6ulirq.devid,IMX6ULIRQ_CNT,IMX6ULIRQ_NAME);
 		/* 函数原型为int register_chrdev_region(dev_t from, unsigned count, const char *name) */
 		/*要申请的起始设备号，也就是给定的设备号；申请的数量，一般都是一个；设备名字 */
 	}else{
-		alloc_chrdev_region(&imx6ulirq.devid,0,IMX6ULIRQ_CNT,IMX6ULIRQ_NAME);
+		ret=alloc_chrdev_region(&imx6ulirq.devid,0,IMX6ULIRQ_CNT,IMX6ULIRQ_NAME);
 		/*函数原型为int alloc_chrdev_region(dev_t *dev,unsigned baseminor,unsigned count,const char *name)*/
 		imx6ulirq.major=MAJOR(imx6ulirq.devid);
 		imx6ulirq.minor=MINOR(imx6ulirq.devid);
 	}
+	if(ret<0){
+		return ret;
+	}
 	printk("imx6ulirq major=%d,minor=%d\r\n",imx6ulirq.major,imx6ulirq.minor);
 
 	/* 2、初始化cdev */
@@ -327,34 +685,60 @@ static int __init imx6ulirq_init(void)
 	/* 函数原型为void cdev_init(struct cdev *cdev, const struct file_operations *fops) */
 
 	/* 3、添加一个cdev*/
-	cdev_add(&imx6ulirq.cdev,imx6ulirq.devid,IMX6ULIRQ_CNT);
+	ret=cdev_add(&imx6ulirq.cdev,imx6ulirq.devid,IMX6ULIRQ_CNT);
 	/* 函数原型int cdev_add(struct cdev *p, dev_t dev, unsigned count) */
+	if(ret<0){
+		goto cdev_fail;
+	}
 
 	/* 4、创建类 */
 	imx6ulirq.class=class_create(THIS_MODULE,IMX6ULIRQ_NAME);
 	/* 函数原型为struct class *class_create (struct module *owner, const char *name) */
-	/* IS_ERR()将传入的值与(unsigned long)-MAX_ERRNO比较，MAX_ERRNO为4095，其含义就是最大错误号，-4095补码为0xfffff001，
-		即大于等于0xfffff001的指针为非法指针，内核一页4k(4095)记录内核空间的错误指针 */
 	if(IS_ERR(imx6ulirq.class)){   /*  判断是否为指针错误，IS_ERR有效指针、空指针返回false，错误指针返回true  */
-		return PTR_ERR(imx6ulirq.class);  /* PTR_ERR()将传入的void *类型指针强转为long类型，从而返回出错误类型 */
+		ret=PTR_ERR(imx6ulirq.class);  /* PTR_ERR()将传入的void *类型指针强转为long类型，从而返回出错误类型 */
+		goto class_fail;
 	}
 
 	/* 5、创建设备 */
-	imx6ulirq.device=device_create(imx6ulirq.class,NULL,imx6ulirq.devid,NULL,IMX6ULIRQ_NAME);
+	imx6ulirq.device=device_create(imx6ulirq.class,&pdev->dev,imx6ulirq.devid,NULL,IMX6ULIRQ_NAME);
 	/* 函数原型为struct device *device_create(struct class *cls, struct device *parent,dev_t devt, void *drvdata,const char *fmt, ...); 
-	参数class就是设备要创建哪个类下面；参数parent是父设备，一般为NULL;参数devt是设备号；参数drvdata是设备可能会使用的一些数据，一般为NULL；
+	参数class就是设备要创建哪个类下面；参数parent是父设备，这里为platform设备;参数devt是设备号；参数drvdata是设备可能会使用的一些数据，一般为NULL；
 	参数fmt是设备名字，如果设置fmt=xxx的话，就会生成/dev/xxx这个设备文件 */
-
-	if(IS_ERR(imx6ulirq.device)){   /*  判断是否为指针错误，IS_ERR有效指针、空指针返回false，错误指针返回true  */
-		return PTR_ERR(imx6ulirq.device);  /* PTR_ERR()将传入的void *类型指针强转为long类型，从而返回出错误类型 */
+	if(IS_ERR(imx6ulirq.device)){
+		ret=PTR_ERR(imx6ulirq.device);
+		goto device_fail;
 	}
 
+	/* 按键可以唤醒系统，设备树中有wakeup-source时默认开启，也可以通过sysfs的power/wakeup修改 */
+	device_set_wakeup_capable(&pdev->dev,true);
+	device_set_wakeup_enable(&pdev->dev,of_property_read_bool(pdev->dev.of_node,"wakeup-source"));
+
 	return 0;
+
+device_fail:
+	class_destroy(imx6ulirq.class);
+class_fail:
+	cdev_del(&imx6ulirq.cdev);
+cdev_fail:
+	unregister_chrdev_region(imx6ulirq.devid,IMX6ULIRQ_CNT);
+	return ret;
 }
 
-/* 驱动出口 */
-static void __exit imx6ulirq_exit(void)
+/*
+ * @description		: platform驱动的remove函数，移除platform驱动的时候此函数会执行，
+ *					  中断、定时器和GPIO由devm在此函数返回后释放
+ * @param - pdev 	: platform设备
+ * @return 			: 0，成功;其他负值,失败
+ */
+static int imx6ulirq_remove(struct platform_device *pdev)
 {
+	device_init_wakeup(&pdev->dev,false);
+
+	/* 摧毁设备，注意先后顺序 */
+	device_destroy(imx6ulirq.class,imx6ulirq.devid);  /* void device_destroy(struct class *cls, dev_t devt); */
+
+	/* 销毁类 */
+	class_destroy(imx6ulirq.class);
 
 	/* 删除cdev字符设备，采用cdev来描述字符设备 */
 	cdev_del(&imx6ulirq.cdev);
@@ -362,15 +746,93 @@ static void __exit imx6ulirq_exit(void)
 	/* 注销设备号 */
 	unregister_chrdev_region(imx6ulirq.devid,IMX6ULIRQ_CNT);
 
-	/* 摧毁设备，注意先后顺序 */
-	device_destroy(imx6ulirq.class,imx6ulirq.devid);  /* void device_destroy(struct class *cls, dev_t devt); */
+	printk("key remove\r\n");
+	return 0;
+}
 
-	/* 销毁类 */
-	class_destroy(imx6ulirq.class);
+#ifdef CONFIG_PM_SLEEP
+/*
+ * @description		: 系统休眠，允许唤醒时把所有按键中断设置为唤醒中断
+ * @param - d 		: platform设备中的device
+ * @return 			: 0 成功;其他 失败
+ */
+static int imx6ulirq_suspend(struct device *d)
+{
+	struct imx6ulirq_dev *dev=&imx6ulirq;
+	int i;
+
+	if(!device_may_wakeup(d)){   /* 通过设备树wakeup-source或者sysfs的power/wakeup设置 */
+		return 0;
+	}
+	dev->suspended=true;
+	for(i=0;i<dev->nkeys;i++){
+		if(enable_irq_wake(dev->irqkeydesc[i].irqnum)<0){
+			printk("%s can't wake up the system!\r\n",dev->irqkeydesc[i].name);
+		}
+	}
+	return 0;
+}
+
+/*
+ * @description		: 系统唤醒，恢复按键中断。唤醒系统的中断在此之前已经重新执行，
+ *					  唤醒原因记录在按键中，由中断线程上报
+ * @param - d 		: platform设备中的device
+ * @return 			: 0 成功;其他 失败
+ */
+static int imx6ulirq_resume(struct device *d)
+{
+	struct imx6ulirq_dev *dev=&imx6ulirq;
+	int i;
+
+	if(!dev->suspended){
+		return 0;
+	}
+	for(i=0;i<dev->nkeys;i++){
+		disable_irq_wake(dev->irqkeydesc[i].irqnum);
+	}
+	dev->suspended=false;
+	return 0;
+}
+#endif
+
+/* 电源管理函数 */
+static SIMPLE_DEV_PM_OPS(imx6ulirq_pm_ops,imx6ulirq_suspend,imx6ulirq_resume);
 
+static struct of_device_id imx6ulirq_of_match[]={   /* 需要包括最后一个空元素 */
+	{.compatible="mytest_key"},
+	{/* Sentinel */}
+};
+MODULE_DEVICE_TABLE(of, imx6ulirq_of_match);
+
+/* platform驱动结构体 */
+static struct platform_driver imx6ulirq_driver={
+	.driver={
+		.name="My_imx6ul_key",   /* 驱动名字，用于和设备匹配 */
+		.of_match_table=imx6ulirq_of_match,
+		.pm=&imx6ulirq_pm_ops,
+	},
+	.probe=imx6ulirq_probe,
+	.remove=imx6ulirq_remove,
+};
 
-	printk("timer_exit\r\n");
+/*
+ * @description	: 驱动模块加载函数
+ * @param 		: 无
+ * @return 		: 无
+ */
+static int __init imx6ulirq_init(void)
+{
+	return platform_driver_register(&imx6ulirq_driver);
+}
 
+/*
+ * @description	: 驱动模块卸载函数
+ * @param 		: 无
+ * @return 		: 无
+ */
+static void __exit imx6ulirq_exit(void)
+{
+	platform_driver_unregister(&imx6ulirq_driver);
 }
 
 /* 注册驱动加载和卸载 */
@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <linux/ioctl.h>
 
 /* 命令值 */
@@ -12,6 +13,48 @@
 #define OPEN_CMD		(_IO(0XEF, 0x2))	/* 打开定时器 */
 #define SETPERIOD_CMD	(_IO(0XEF, 0x3))	/* 设置定时器周期命令 */
 
+/* 按键事件，和驱动中的定义一致 */
+struct key_event {
+	unsigned long long timestamp;	/* 按键边沿的时间，CLOCK_MONOTONIC，单位ns */
+	unsigned char key;				/* 按键编号 */
+	unsigned char value;			/* 0XE0：按下，0XF0：按下后释放 */
+	unsigned char flags;			/* 0X01：这个按键唤醒了系统 */
+	unsigned char reserved;
+	unsigned int dropped;			/* 读得太慢丢失的事件总数 */
+};
+
+/*
+ * @description		: 一次读出所有按键事件并打印
+ * @param - fd 		: 文件描述符
+ * @return 			: 读出的事件数，负值表示读取失败
+ */
+static int read_key_events(int fd)
+{
+    static unsigned int dropped=0;   /* 上次打印时的丢失事件数 */
+    struct key_event events[16];
+    struct timespec now;
+    unsigned long long nowns;
+    int ret, i;
+
+    ret=read(fd,events,sizeof(events));
+    if(ret<0){   /* 数据读取错误或无效 */
+        return ret;
+    }
+    /* 驱动中的时间也是CLOCK_MONOTONIC，相减得到从按键边沿到应用读到事件的延迟 */
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    nowns=now.tv_sec*1000000000ULL+now.tv_nsec;
+    for(i=0;i<ret/(int)sizeof(events[0]);i++){
+        if(events[i].dropped!=dropped){   /* 读得太慢，中间有事件被覆盖 */
+            printf("%u key events dropped\r\n",events[i].dropped-dropped);
+            dropped=events[i].dropped;
+        }
+        printf("key%d value data=%#X time=%llu.%06llu latency=%lluus%s\r\n",events[i].key,events[i].value,
+               events[i].timestamp/1000000000ULL,(events[i].timestamp/1000ULL)%1000000ULL,
+               (nowns-events[i].timestamp)/1000ULL,(events[i].flags & 0X01) ? " wakeup" : "");
+    }
+    return i;
+}
+
 /* 字符设备应用开发 */
 /*
  * @description		: main主程序
@@ -26,7 +69,6 @@ int main(int argc, char *argv[])
     int fd;
     int ret=0;
     char *filename;
-    unsigned char data;
     
     if(argc!= 2){
 		printf("Error Usage!\r\n");
@@ -43,14 +85,7 @@ int main(int argc, char *argv[])
     }
 
     while(1){
-        ret=read(fd,&data,sizeof(data));
-        if(ret<0){   /* 数据读取错误或无效 */
-    
-        }else{
-            if(data){   /* 读取到正确数据 */
-                printf("key value data=%#X\r\n",data);
-            }
-        }
+        read_key_events(fd);   /* 一次读出多个事件 */
     }
 
     ret=close(fd);
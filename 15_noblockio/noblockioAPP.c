@@ -8,20 +8,156 @@
 #include "poll.h"
 #include "sys/select.h"
 #include "sys/time.h"
+#include "time.h"
 #include "linux/ioctl.h"
+#include "sys/epoll.h"
+#include "sys/resource.h"
+#include "sys/wait.h"
 
 /* 命令值 */
 #define CLOSE_CMD 		(_IO(0XEF, 0x1))	/* 关闭定时器 */
 #define OPEN_CMD		(_IO(0XEF, 0x2))	/* 打开定时器 */
 #define SETPERIOD_CMD	(_IO(0XEF, 0x3))	/* 设置定时器周期命令 */
 
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE	(1u << 28)	/* 4.5以后的内核才支持，老内核会忽略这个标志 */
+#endif
+
+/* 按键事件，和驱动中的定义一致 */
+struct key_event {
+	unsigned long long timestamp;	/* 按键边沿的时间，CLOCK_MONOTONIC，单位ns */
+	unsigned char key;				/* 按键编号 */
+	unsigned char value;			/* 0XE0：按下，0XF0：按下后释放 */
+	unsigned char flags;			/* 0X01：这个按键唤醒了系统 */
+	unsigned char reserved;
+	unsigned int dropped;			/* 读得太慢丢失的事件总数 */
+};
+
+/*
+ * @description		: 一次读出所有按键事件并打印
+ * @param - fd 		: 文件描述符
+ * @return 			: 读出的事件数，负值表示读取失败
+ */
+static int read_key_events(int fd)
+{
+    static unsigned int dropped=0;   /* 上次打印时的丢失事件数 */
+    struct key_event events[16];
+    struct timespec now;
+    unsigned long long nowns;
+    int ret, i;
+
+    ret=read(fd,events,sizeof(events));
+    if(ret<0){   /* 数据读取错误或无效 */
+        return ret;
+    }
+    /* 驱动中的时间也是CLOCK_MONOTONIC，相减得到从按键边沿到应用读到事件的延迟 */
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    nowns=now.tv_sec*1000000000ULL+now.tv_nsec;
+    for(i=0;i<ret/(int)sizeof(events[0]);i++){
+        if(events[i].dropped!=dropped){   /* 读得太慢，中间有事件被覆盖 */
+            printf("%u key events dropped\r\n",events[i].dropped-dropped);
+            dropped=events[i].dropped;
+        }
+        printf("key%d value data=%#X time=%llu.%06llu latency=%lluus%s\r\n",events[i].key,events[i].value,
+               events[i].timestamp/1000000000ULL,(events[i].timestamp/1000ULL)%1000000ULL,
+               (nowns-events[i].timestamp)/1000ULL,(events[i].flags & 0X01) ? " wakeup" : "");
+    }
+    return i;
+}
+
+/*
+ * @description		: epoll唤醒测试的子进程，统计被唤醒的次数、其中没有读到事件的次数和CPU时间
+ * @param - fd 		: 文件描述符，shared时为所有子进程共用的文件
+ * @param - id 		: 子进程编号
+ * @param - seconds : 测试时间
+ * @return 			: 无
+ */
+static void bench_child(int fd,int id,int seconds)
+{
+    struct epoll_event ev;
+    struct key_event events[16];
+    struct rusage usage;
+    time_t end=time(NULL)+seconds;
+    int epfd,ret,got;
+    int wakeups=0,spurious=0,nevents=0;
+
+    epfd=epoll_create(1);
+    ev.events=EPOLLIN|EPOLLET|EPOLLEXCLUSIVE;   /* 边沿触发，共用一个文件时互斥唤醒 */
+    ev.data.fd=fd;
+    if(epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev)<0){
+        printf("epoll_ctl failed!\r\n");
+        exit(-1);
+    }
+
+    while(time(NULL)<end){
+        if(epoll_wait(epfd,&ev,1,100)<=0){   /* 超时，检查测试时间 */
+            continue;
+        }
+        wakeups++;
+        got=0;
+        while((ret=read(fd,events,sizeof(events)))>0){   /* 边沿触发，一直读到没有事件 */
+            got+=ret/sizeof(events[0]);
+        }
+        if(got==0){   /* 被唤醒了但是事件已经被别的进程读走了 */
+            spurious++;
+        }
+        nevents+=got;
+    }
+
+    getrusage(RUSAGE_SELF,&usage);
+    printf("reader%d: wakeups=%d spurious=%d events=%d cpu=%ldus\r\n",id,wakeups,spurious,nevents,
+           usage.ru_utime.tv_sec*1000000L+usage.ru_utime.tv_usec+usage.ru_stime.tv_sec*1000000L+usage.ru_stime.tv_usec);
+    exit(0);
+}
+
+/*
+ * @description		: epoll唤醒测试，N个进程同时等待按键，测试期间不停地按键，
+ *					  比较每个进程被唤醒的次数和CPU时间
+ * @param - filename: 设备文件
+ * @param - n 		: 等待的进程数
+ * @param - seconds : 测试时间
+ * @param - shared 	: 1 所有进程共用一个文件;0 每个进程打开自己的文件，都能收到所有事件
+ * @return 			: 0 成功;其他 失败
+ */
+static int bench(char *filename,int n,int seconds,int shared)
+{
+    int fd=-1;
+    int i;
+
+    if(shared){
+        fd=open(filename,O_RDWR|O_NONBLOCK);
+        if(fd<0){
+            printf("file %s open failed!\r\n",filename);
+            return -1;
+        }
+    }
+    for(i=0;i<n;i++){
+        if(fork()==0){
+            if(!shared){
+                fd=open(filename,O_RDWR|O_NONBLOCK);
+                if(fd<0){
+                    printf("file %s open failed!\r\n",filename);
+                    exit(-1);
+                }
+            }
+            bench_child(fd,i,seconds);
+        }
+    }
+    while(wait(NULL)>0);   /* 等待所有子进程退出 */
+    if(shared){
+        close(fd);
+    }
+    return 0;
+}
+
 /* 字符设备应用开发 */
 /*
  * @description		: main主程序
  * @param - argc 	: argv数组元素个数，应用程序参数个数，如使用 ls -l：argv=2，argv为字符串 
  * @param - argv[] 	: 具体参数
  * @return 			: 0 成功;其他 失败
- * 使用方法	 ：./imx6ullirqAPP /dev/imx6ullirq 	
+ * 使用方法	 ：./noblockioAPP /dev/noblockio 	
+ *            ./noblockioAPP /dev/noblockio bench <进程数> <秒数> [shared] 	epoll唤醒测试
  */
 
 int main(int argc, char *argv[])
@@ -29,11 +165,13 @@ int main(int argc, char *argv[])
     int fd;
     int ret=0;
     char *filename;
-    unsigned char data;
     fd_set readfds;
     struct timeval timerout;
     struct pollfd fds;
     
+    if(argc>=5 && !strcmp(argv[2],"bench")){
+        return bench(argv[1],atoi(argv[3]),atoi(argv[4]),argc>5 && !strcmp(argv[5],"shared"));
+    }
     if(argc!= 2){
 		printf("Error Usage!\r\n");
 		return -1;
@@ -57,14 +195,7 @@ int main(int argc, char *argv[])
         ret=poll(&fds,1,500);
         /* 函数原型 int poll(struct pollfd *fds, nfds_t nfds, int timeout) */
         if(ret){  /* 数据有效，读取数据 */
-            ret=read(fd,&data,sizeof(data));
-            if(ret<0){   /* 数据读取错误或无效 */
-    
-            }else{
-                if(data){   /* 读取到正确数据 */
-                    printf("key value data=%#X\r\n",data);
-                }
-            }    
+            read_key_events(fd);
         }else if(ret==0){  /* 超时 */
             /* 超时处理 */
         }else if(ret<0){  /* 错误 */
@@ -92,14 +223,7 @@ int main(int argc, char *argv[])
                 break;
             default:
                 if(FD_ISSET(fd,&readfds)){   /* 用于测试一个文件是否属于某个集合 */
-                    ret=read(fd,&data,sizeof(data));
-                    if(ret<0){   /* 数据读取错误或无效 */
-    
-                    }else{
-                        if(data){   /* 读取到正确数据 */
-                            printf("key value data=%#X\r\n",data);
-                        }
-                    }
+                    read_key_events(fd);   /* 一次读出多个事件 */
                 }
                 break;
         }
@@ -5,19 +5,66 @@
 #include "fcntl.h"
 #include "stdlib.h"
 #include "string.h"
+#include "time.h"
 #include "poll.h"
 #include "sys/select.h"
 #include "sys/time.h"
 #include "linux/ioctl.h"
 #include "signal.h"
+#include "sys/ioctl.h"
+#include "sys/eventfd.h"
+#include "stdint.h"
 
 /* 命令值 */
 #define CLOSE_CMD 		(_IO(0XEF, 0x1))	/* 关闭定时器 */
 #define OPEN_CMD		(_IO(0XEF, 0x2))	/* 打开定时器 */
 #define SETPERIOD_CMD	(_IO(0XEF, 0x3))	/* 设置定时器周期命令 */
+#define KEY_EVENTFD_CMD	(_IOW(0XEF, 0x4, int))	/* 用eventfd接收按键通知 */
 
 static int fd=0;  /* 文件描述符 */
 
+/* 按键事件，和驱动中的定义一致 */
+struct key_event {
+	unsigned long long timestamp;	/* 按键边沿的时间，CLOCK_MONOTONIC，单位ns */
+	unsigned char key;				/* 按键编号 */
+	unsigned char value;			/* 0XE0：按下，0XF0：按下后释放 */
+	unsigned char flags;			/* 0X01：这个按键唤醒了系统 */
+	unsigned char reserved;
+	unsigned int dropped;			/* 读得太慢丢失的事件总数 */
+};
+
+/*
+ * @description		: 一次读出所有按键事件并打印
+ * @param - fd 		: 文件描述符
+ * @return 			: 读出的事件数，负值表示读取失败
+ */
+static int read_key_events(int fd)
+{
+    static unsigned int dropped=0;   /* 上次打印时的丢失事件数 */
+    struct key_event events[16];
+    struct timespec now;
+    unsigned long long nowns;
+    int ret, i;
+
+    ret=read(fd,events,sizeof(events));
+    if(ret<0){   /* 数据读取错误或无效 */
+        return ret;
+    }
+    /* 驱动中的时间也是CLOCK_MONOTONIC，相减得到从按键边沿到应用读到事件的延迟 */
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    nowns=now.tv_sec*1000000000ULL+now.tv_nsec;
+    for(i=0;i<ret/(int)sizeof(events[0]);i++){
+        if(events[i].dropped!=dropped){   /* 读得太慢，中间有事件被覆盖 */
+            printf("%u key events dropped\r\n",events[i].dropped-dropped);
+            dropped=events[i].dropped;
+        }
+        printf("key%d value data=%#X time=%llu.%06llu latency=%lluus%s\r\n",events[i].key,events[i].value,
+               events[i].timestamp/1000000000ULL,(events[i].timestamp/1000ULL)%1000000ULL,
+               (nowns-events[i].timestamp)/1000ULL,(events[i].flags & 0X01) ? " wakeup" : "");
+    }
+    return i;
+}
+
 /*
  * SIGIO信号处理函数
  * @param - signum 	: 信号值
@@ -28,17 +75,44 @@ static int fd=0;  /* 文件描述符 */
  */
 static void sigio_signal_func(int signum)
 {
-    unsigned char keyvalue;
-    int ret;
+    /* 驱动会把一段时间内的按键事件合并成一个SIGIO，所以一直读到没有事件为止 */
+    while(read_key_events(fd)>0);
+}
 
-    ret=read(fd,&keyvalue,sizeof(keyvalue));   /*此函数通过 read 函数读取按键值，然后通过printf 函数打印在终端上*/
-    if(ret<0){   /* 数据读取错误或无效 */
-    
-    }else{
-        if(keyvalue){   /* 读取到正确数据 */
-            printf("key value data=%#X\r\n",keyvalue);
+/*
+ * @description		: 用eventfd代替SIGIO接收通知，在poll中等待，不需要信号处理函数
+ * @param - fd 		: 按键设备的文件描述符
+ * @return 			: 0 成功;其他 失败
+ */
+static int eventfd_loop(int fd)
+{
+    struct pollfd fds;
+    uint64_t count;
+    int efd;
+
+    efd=eventfd(0,EFD_NONBLOCK);
+    if(efd<0){
+        printf("eventfd create failed!\r\n");
+        return -1;
+    }
+    if(ioctl(fd,KEY_EVENTFD_CMD,&efd)<0){
+        printf("set eventfd failed!\r\n");
+        close(efd);
+        return -1;
+    }
+
+    fds.fd=efd;
+    fds.events=POLLIN;
+    while(1){
+        if(poll(&fds,1,-1)<=0){
+            continue;
         }
-    }    
+        read(efd,&count,sizeof(count));   /* 读出计数并清零，count为合并之前的通知次数 */
+        while(read_key_events(fd)>0);
+    }
+
+    close(efd);
+    return 0;
 }
 
 /* 字符设备应用开发 */
@@ -47,7 +121,7 @@ static void sigio_signal_func(int signum)
  * @param - argc 	: argv数组元素个数，应用程序参数个数，如使用 ls -l：argv=2，argv为字符串 
  * @param - argv[] 	: 具体参数
  * @return 			: 0 成功;其他 失败
- * 使用方法	 ：./imx6ullirqAPP /dev/imx6ullirq 	
+ * 使用方法	 ：./asyncnotiAPP /dev/asyncnoti [eventfd]	加上eventfd时用eventfd代替SIGIO
  */
 
 int main(int argc, char *argv[])
@@ -56,7 +130,7 @@ int main(int argc, char *argv[])
     int flags=0;
     char *filename;
     
-    if(argc!= 2){
+    if(argc!= 2 && argc!=3){
 		printf("Error Usage!\r\n");
 		return -1;
 	}
@@ -70,6 +144,12 @@ int main(int argc, char *argv[])
 		return -1;
     }
 
+    if(argc==3 && !strcmp(argv[2],"eventfd")){   /* 用eventfd接收通知 */
+        ret=eventfd_loop(fd);
+        close(fd);
+        return ret;
+    }
+
     /* 设置信号SIGIO的处理函数 */
     signal(SIGIO,sigio_signal_func);
     /* 函数原型sighandler_t signal(int signum, sighandler_t handler) */
@@ -4,18 +4,84 @@
 #include <linux/ide.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/errno.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/uio.h>
+#include <linux/fs.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
 
 #define CHRDEVBASE_MAJOR 	200   		 // 主设备号
 #define CHRDEVBASE_NAME  "chrdevbase"   // 名字
 
-static char readbuf[100];   /* 读缓冲区 */
-static char writebuf[100];  /* 写缓冲区 */
-static char kerneldata[]={"kernel data!"};
+#define CHRDEVBASE_SYNC_CMD	(_IO(0XEE, 0x1))	/* 通过mmap修改了head/tail之后，唤醒等待的读写进程 */
+
+/* 环形缓冲区大小，单位KB，会向上取整为2的幂，最小为一页 */
+static unsigned int ring_size = 64;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Ring buffer size in KB (rounded up to a power of two)");
 
 /* 字符设备驱动
   * 主要就是驱动对应的open、close、read等，即file_operations结构体的成员变量实现
   * */
 
+/*
+ * 环形缓冲区控制页，位于mmap映射的第一页，数据区紧跟在控制页后面(偏移data_offset)。
+ * head和tail都是自由增长的计数，head-tail为已用字节数，取模size得到数据区下标。
+ * read/write会更新head/tail，应用程序也可以通过mmap直接读写数据区并修改head/tail，
+ * 修改后调用CHRDEVBASE_SYNC_CMD唤醒等待的进程。应用程序需要包含同样的结构体定义
+ */
+struct chrdevbase_ring {
+	unsigned int size;			/* 数据区大小，2的幂 */
+	unsigned int data_offset;	/* 数据区相对映射起始地址的偏移 */
+	unsigned int head;			/* 写位置，只由写者修改 */
+	unsigned int tail;			/* 读位置，只由读者修改 */
+};
+
+/* chrdevbase设备结构体 */
+struct chrdevbase_dev {
+	struct chrdevbase_ring *ring;	/* 控制页，和数据区一起用vmalloc_user分配，可以映射到用户空间 */
+	char *data;						/* 数据区 */
+	unsigned int size;				/* 数据区大小 */
+	struct mutex rlock;				/* 读者之间互斥 */
+	struct mutex wlock;				/* 写者之间互斥 */
+	wait_queue_head_t rwait;		/* 等待数据的读进程 */
+	wait_queue_head_t wwait;		/* 等待空间的写进程 */
+};
+
+static struct chrdevbase_dev chrdevbase;
+
+/*
+ * @description	: 环形缓冲区中已有的数据字节数，head/tail可能被应用程序通过mmap修改，
+ *				  不合法时按空处理
+ * @param - dev	: 设备
+ * @return 		: 已用字节数
+ */
+static unsigned int chrdevbase_used(struct chrdevbase_dev *dev)
+{
+	unsigned int used = ACCESS_ONCE(dev->ring->head) - ACCESS_ONCE(dev->ring->tail);
+
+	return used > dev->size ? 0 : used;
+}
+
+/*
+ * @description	: 环形缓冲区中剩余的空间字节数
+ * @param - dev	: 设备
+ * @return 		: 剩余字节数
+ */
+static unsigned int chrdevbase_space(struct chrdevbase_dev *dev)
+{
+	unsigned int used = ACCESS_ONCE(dev->ring->head) - ACCESS_ONCE(dev->ring->tail);
+
+	return used > dev->size ? 0 : dev->size - used;
+}
+
 /*
  * @description		: 打开设备
  * @param - inode 	: 传递给驱动的inode
@@ -25,61 +91,330 @@ static char kerneldata[]={"kernel data!"};
  */
 
 /* static+函数就变为静态函数，其作用域由之前的整个项目内的文件都可访问变为了只能在本文件内被访问 */
-static int chrdevbase_open(struct inode *inode, struct file *filp)     
+static int chrdevbase_open(struct inode *inode, struct file *filp)
 {
-	// printk("chrdevbase_open\r\n");
-	return 0;
+	filp->private_data = &chrdevbase;
+	return nonseekable_open(inode, filp);	/* 环形缓冲区没有文件偏移的概念 */
 }
 
 /*
- * @description		: 从设备读取数据 
- * @param - filp 	: 要打开的设备文件(文件描述符)
- * @param - buf 	: 返回给用户空间的数据缓冲区
- * @param - cnt 	: 要读取的数据长度
- * @param - offt 	: 相对于文件首地址的偏移
- * @return 			: 读取的字节数，如果为负值，表示读取失败
+ * @description		: 等待环形缓冲区中有数据，成功返回时持有rlock
+ * @param - dev 	: 设备
+ * @param - nonblock: 是否为非阻塞访问
+ * @return 			: 已有的数据字节数，如果为负值，表示失败
  */
-static ssize_t chrdevbase_read(struct file *filp, char __user *buf, size_t cnt, loff_t *offt)
+static int chrdevbase_lock_readable(struct chrdevbase_dev *dev, bool nonblock)
 {
-	int ret=0;
-	/* 向用户空间发送数据 */
-	memcpy(readbuf,kerneldata,sizeof(kerneldata));   /* 内存拷贝 */
-	ret=copy_to_user(buf,readbuf,cnt);  /* 应用程序不能直接访问内核数据，驱动给应用传递数据需要用到copy_to_user，
-				函数原型为：static inline long copy_to_user(void __user *to, const void *from, unsigned long n)
-				to表示目的，from表示源，n表示要复制的数据长度。复制成功，返回值为0，如果复制失败则返回负数 */
-	if(ret == 0){
-		printk("kernel senddata ok!\r\n");
-	}else{
-		printk("kernel senddata failed!\r\n");
+	unsigned int used;
+	int ret;
+
+	if (mutex_lock_interruptible(&dev->rlock))
+		return -ERESTARTSYS;
+
+	while ((used = chrdevbase_used(dev)) == 0) {
+		mutex_unlock(&dev->rlock);
+		if (nonblock)		/* 非阻塞访问 */
+			return -EAGAIN;
+		ret = wait_event_interruptible(dev->rwait, chrdevbase_used(dev) != 0);
+		if (ret)
+			return ret;
+		if (mutex_lock_interruptible(&dev->rlock))
+			return -ERESTARTSYS;
 	}
+	smp_rmb();		/* 先看到head，再读数据 */
+	return used;
+}
 
-	// printk("chrdevbase_read\r\n");
-	return 0;
-	
+/*
+ * @description		: 等待环形缓冲区中有空间，成功返回时持有wlock
+ * @param - dev 	: 设备
+ * @param - nonblock: 是否为非阻塞访问
+ * @return 			: 剩余的空间字节数，如果为负值，表示失败
+ */
+static int chrdevbase_lock_writable(struct chrdevbase_dev *dev, bool nonblock)
+{
+	unsigned int space;
+	int ret;
+
+	if (mutex_lock_interruptible(&dev->wlock))
+		return -ERESTARTSYS;
+
+	while ((space = chrdevbase_space(dev)) == 0) {
+		mutex_unlock(&dev->wlock);
+		if (nonblock)
+			return -EAGAIN;
+		ret = wait_event_interruptible(dev->wwait, chrdevbase_space(dev) != 0);
+		if (ret)
+			return ret;
+		if (mutex_lock_interruptible(&dev->wlock))
+			return -ERESTARTSYS;
+	}
+	smp_mb();		/* 先看到tail，再覆盖读者已经读完的数据 */
+	return space;
+}
+
+/*
+ * @description		: 释放已经读走的数据，需要持有rlock
+ * @param - dev 	: 设备
+ * @param - done 	: 读走的字节数
+ * @return 			: 无
+ */
+static void chrdevbase_consume(struct chrdevbase_dev *dev, unsigned int done)
+{
+	smp_mb();		/* 数据读完之后再释放空间 */
+	ACCESS_ONCE(dev->ring->tail) = dev->ring->tail + done;
+	wake_up_interruptible(&dev->wwait);
+}
+
+/*
+ * @description		: 发布已经写入的数据，需要持有wlock
+ * @param - dev 	: 设备
+ * @param - done 	: 写入的字节数
+ * @return 			: 无
+ */
+static void chrdevbase_produce(struct chrdevbase_dev *dev, unsigned int done)
+{
+	smp_wmb();		/* 数据写完之后再发布head */
+	ACCESS_ONCE(dev->ring->head) = dev->ring->head + done;
+	wake_up_interruptible(&dev->rwait);
+}
+
+/*
+ * @description		: 从设备读取数据，支持read和readv，有多少数据就读多少，
+ *					  最多填满iov_iter，没有数据时阻塞(或者返回-EAGAIN)
+ * @param - iocb 	: I/O控制块
+ * @param - to 		: 用户空间的缓冲区，可以由多段组成
+ * @return 			: 读取的字节数，如果为负值，表示读取失败
+ */
+static ssize_t chrdevbase_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct chrdevbase_dev *dev = filp->private_data;
+	unsigned int off, len, first, done;
+	int ret;
+
+	if (iov_iter_count(to) == 0)
+		return 0;
+
+	ret = chrdevbase_lock_readable(dev, filp->f_flags & O_NONBLOCK);
+	if (ret < 0)
+		return ret;
+
+	off = dev->ring->tail & (dev->size - 1);
+	len = min_t(size_t, ret, iov_iter_count(to));
+	first = min(len, dev->size - off);	/* 数据可能绕回缓冲区开头，分两段拷贝 */
+
+	/* copy_to_iter返回实际拷贝的字节数，遇到无效的用户地址时会变少 */
+	done = copy_to_iter(dev->data + off, first, to);
+	if (done == first && len > first)
+		done += copy_to_iter(dev->data, len - first, to);
+
+	if (done)
+		chrdevbase_consume(dev, done);
+	mutex_unlock(&dev->rlock);
+	return done ? done : -EFAULT;
 }
 
 /*
- * @description		: 向设备写数据 
- * @param - filp 	: 设备文件，表示打开的文件描述符
- * @param - buf 	: 要写给设备写入的数据
- * @param - cnt 	: 要写入的数据长度，字节
- * @param - offt 	: 相对于文件首地址的偏移
+ * @description		: 向设备写数据，支持write和writev，有多少空间就写多少，
+ *					  缓冲区满时阻塞(或者返回-EAGAIN)
+ * @param - iocb 	: I/O控制块
+ * @param - from 	: 要写入的数据，可以由多段组成
  * @return 			: 写入的字节数，如果为负值，表示写入失败
  */
-static ssize_t chrdevbase_write(struct file *filp, const char __user *buf, size_t cnt, loff_t *offt)
+static ssize_t chrdevbase_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	int ret=0;
-	/* 接收用户空间传递给内核的数据并且打印出来  */
-	ret=copy_from_user(writebuf,buf,cnt);  /* 将用户空间的数据复制到writebuf这个内核空间中 */
+	struct file *filp = iocb->ki_filp;
+	struct chrdevbase_dev *dev = filp->private_data;
+	unsigned int off, len, first, done;
+	int ret;
+
+	if (iov_iter_count(from) == 0)
+		return 0;
 
-	if(ret == 0){
-		printk("kernel recevdata:%s\r\n", writebuf);
-	}else{
-		printk("kernel recevdata failed!\r\n");
+	ret = chrdevbase_lock_writable(dev, filp->f_flags & O_NONBLOCK);
+	if (ret < 0)
+		return ret;
+
+	off = dev->ring->head & (dev->size - 1);
+	len = min_t(size_t, ret, iov_iter_count(from));
+	first = min(len, dev->size - off);
+
+	done = copy_from_iter(dev->data + off, first, from);
+	if (done == first && len > first)
+		done += copy_from_iter(dev->data, len - first, from);
+
+	if (done)
+		chrdevbase_produce(dev, done);
+	mutex_unlock(&dev->wlock);
+	return done ? done : -EFAULT;
+}
+
+/*
+ * @description		: splice_read中分配的页没有放入管道时，由splice_to_pipe调用释放
+ * @param - spd 	: splice描述
+ * @param - i 		: 页的下标
+ * @return 			: 无
+ */
+static void chrdevbase_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	__free_page(spd->pages[i]);
+}
+
+/* 放入管道的页是驱动自己分配的普通页，使用通用的管道缓冲区操作 */
+static const struct pipe_buf_operations chrdevbase_pipe_buf_ops = {
+	.can_merge = 0,
+	.confirm = generic_pipe_buf_confirm,
+	.release = generic_pipe_buf_release,
+	.steal = generic_pipe_buf_steal,
+	.get = generic_pipe_buf_get,
+};
+
+/*
+ * @description		: 把环形缓冲区中的数据splice到管道，数据不经过用户空间。
+ *					  环形缓冲区的空间释放后会被写者覆盖，不能直接把它的页交给管道，
+ *					  所以先拷贝到新分配的页中，只在内核中拷贝一次
+ * @param - in 		: 设备文件
+ * @param - ppos 	: 文件偏移，环形缓冲区没有使用
+ * @param - pipe 	: 管道
+ * @param - len 	: 最多传输的字节数
+ * @param - flags 	: splice标志
+ * @return 			: 传输的字节数，如果为负值，表示失败
+ */
+static ssize_t chrdevbase_splice_read(struct file *in, loff_t *ppos,
+				struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct chrdevbase_dev *dev = in->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.flags = flags,
+		.ops = &chrdevbase_pipe_buf_ops,
+		.spd_release = chrdevbase_spd_release,
+	};
+	unsigned int pos, off, chunk, first, copied = 0;
+	ssize_t ret;
+
+	if (len == 0)
+		return 0;
+
+	if (splice_grow_spd(pipe, &spd))	/* 管道可能比默认的大 */
+		return -ENOMEM;
+
+	ret = chrdevbase_lock_readable(dev, (in->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK));
+	if (ret < 0)
+		goto out;
+
+	len = min_t(size_t, ret, len);
+	pos = dev->ring->tail;
+	while (copied < len && spd.nr_pages < spd.nr_pages_max) {
+		struct page *page = alloc_page(GFP_KERNEL);
+		char *dst;
+
+		if (!page)
+			break;
+		dst = page_address(page);
+		chunk = min_t(unsigned int, len - copied, PAGE_SIZE);
+		off = (pos + copied) & (dev->size - 1);
+		first = min(chunk, dev->size - off);
+		memcpy(dst, dev->data + off, first);
+		memcpy(dst + first, dev->data, chunk - first);
+
+		spd.pages[spd.nr_pages] = page;
+		spd.partial[spd.nr_pages].offset = 0;
+		spd.partial[spd.nr_pages].len = chunk;
+		spd.nr_pages++;
+		copied += chunk;
 	}
 
-	// printk("chrdevbase_write\r\n");
-	return 0;
+	if (spd.nr_pages == 0) {
+		ret = -ENOMEM;
+	} else {
+		/* 返回放入管道的字节数，管道满时可能只放入一部分，没放入的页由spd_release释放 */
+		ret = splice_to_pipe(pipe, &spd);
+		if (ret > 0)
+			chrdevbase_consume(dev, ret);
+	}
+	mutex_unlock(&dev->rlock);
+out:
+	splice_shrink_spd(&spd);
+	return ret;
+}
+
+/*
+ * @description		: 把管道中的数据splice到环形缓冲区，由iter_file_splice_write
+ *					  把管道中的页组成iov_iter，一次调用write_iter写入
+ * @param - pipe 	: 管道
+ * @param - out 	: 设备文件
+ * @param - ppos 	: 文件偏移，环形缓冲区没有使用
+ * @param - len 	: 最多传输的字节数
+ * @param - flags 	: splice标志
+ * @return 			: 传输的字节数，如果为负值，表示失败
+ */
+static ssize_t chrdevbase_splice_write(struct pipe_inode_info *pipe, struct file *out,
+				loff_t *ppos, size_t len, unsigned int flags)
+{
+	return iter_file_splice_write(pipe, out, ppos, len, flags);
+}
+
+/*
+ * @description		: poll函数，有数据可读返回POLLIN，有空间可写返回POLLOUT
+ * @param - filp 	: 要打开的设备文件(文件描述符)
+ * @param - wait 	: 等待列表(poll_table)
+ * @return 			: 设备或者资源状态
+ */
+static unsigned int chrdevbase_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	struct chrdevbase_dev *dev = filp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &dev->rwait, wait);
+	poll_wait(filp, &dev->wwait, wait);
+
+	if (chrdevbase_used(dev))
+		mask |= POLLIN | POLLRDNORM;
+	if (chrdevbase_space(dev))
+		mask |= POLLOUT | POLLWRNORM;
+	return mask;
+}
+
+/*
+ * @description		: 把控制页和数据区映射到用户空间，偏移0为控制页，偏移PAGE_SIZE开始为数据区
+ * @param - filp 	: 要打开的设备文件(文件描述符)
+ * @param - vma 	: 用户空间的虚拟内存区域
+ * @return 			: 0 成功;其他 失败
+ */
+static int chrdevbase_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct chrdevbase_dev *dev = filp->private_data;
+
+	/* 映射范围超出分配的内存时返回-EINVAL */
+	return remap_vmalloc_range(vma, dev->ring, vma->vm_pgoff);
+}
+
+/*
+ * @description		: ioctl函数
+ * @param - filp 	: 要打开的设备文件(文件描述符)
+ * @param - cmd 	: 应用程序发送过来的命令
+ * @param - arg 	: 参数
+ * @return 			: 0 成功;其他 失败
+ */
+static long chrdevbase_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct chrdevbase_dev *dev = filp->private_data;
+
+	switch (cmd) {
+	case CHRDEVBASE_SYNC_CMD:	/* 应用程序通过mmap生产或者消费了数据 */
+		smp_mb();
+		wake_up_interruptible(&dev->rwait);
+		wake_up_interruptible(&dev->wwait);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
 }
 
 /*
@@ -87,7 +422,7 @@ static ssize_t chrdevbase_write(struct file *filp, const char __user *buf, size_
  * @param - filp 	: 要关闭的设备文件(文件描述符)
  * @return 			: 0 成功;其他 失败
  */
-static int chrdevbase_release(struct inode *inode, struct file *filp)     
+static int chrdevbase_release(struct inode *inode, struct file *filp)
 {
 	// printk("chrdevbase_close\r\n");
 	return 0;
@@ -99,31 +434,53 @@ static int chrdevbase_release(struct inode *inode, struct file *filp)
 static struct file_operations chrdevbase_fops={
 	.owner = THIS_MODULE,
 	.open =  chrdevbase_open,
-	.read =chrdevbase_read,
-	.write=chrdevbase_write,
+	.read_iter = chrdevbase_read_iter,
+	.write_iter = chrdevbase_write_iter,
+	.splice_read = chrdevbase_splice_read,
+	.splice_write = chrdevbase_splice_write,
+	.poll = chrdevbase_poll,
+	.mmap = chrdevbase_mmap,
+	.unlocked_ioctl = chrdevbase_ioctl,
+	.llseek = no_llseek,
 	.release = chrdevbase_release,
 };
 
 /*
- * @description	: 驱动入口函数 
+ * @description	: 驱动入口函数
  * @param 		: 无
  * @return 		: 0 成功;其他 失败
 */
 static int __init chrdevbase_init(void)
 {
 	int ret=0;
-	 
+	unsigned long size;
+
+	/* 申请环形缓冲区，控制页+数据区，vmalloc_user分配的内存已经清零并且可以映射到用户空间 */
+	size = roundup_pow_of_two(max_t(unsigned long, ring_size * 1024UL, PAGE_SIZE));
+	chrdevbase.ring = vmalloc_user(PAGE_SIZE + size);
+	if (!chrdevbase.ring)
+		return -ENOMEM;
+	chrdevbase.data = (char *)chrdevbase.ring + PAGE_SIZE;
+	chrdevbase.size = size;
+	chrdevbase.ring->size = size;
+	chrdevbase.ring->data_offset = PAGE_SIZE;
+	mutex_init(&chrdevbase.rlock);
+	mutex_init(&chrdevbase.wlock);
+	init_waitqueue_head(&chrdevbase.rwait);
+	init_waitqueue_head(&chrdevbase.wwait);
+
 	/* 注册字符设备，linux内核启动 */
 	ret=register_chrdev(CHRDEVBASE_MAJOR,CHRDEVBASE_NAME,&chrdevbase_fops);
-	MKDEV
 
 	// 包括major、minor和name，其中设备号由主设备号和此设备号两部分组成，由dev_t数据类型确定（unsigned int）
-	// 32位组成，其中高12位(0~4095)为主设备号(MAJOR(dev_t))，低20位次设备号(MINOR(dev_t)) 
+	// 32位组成，其中高12位(0~4095)为主设备号(MAJOR(dev_t))，低20位次设备号(MINOR(dev_t))
 
 	if(ret < 0){
 		printk("chrdevbase driver register failed\r\n");
+		vfree(chrdevbase.ring);
+		return ret;
 	}
-	printk("chrdevbase init!\r\n");  /* printf运行在用户态，printk运行在内核态（向控制台输出或显示一些内容），默认等级为4，KERN_WARNING */
+	printk("chrdevbase init! ring size %u\r\n", chrdevbase.size);  /* printf运行在用户态，printk运行在内核态（向控制台输出或显示一些内容），默认等级为4，KERN_WARNING */
 	return 0;
 }
 
@@ -137,6 +494,9 @@ static void __exit chrdevbase_exit(void)
 	/* 注销字符设备 */
 	unregister_chrdev(CHRDEVBASE_MAJOR,CHRDEVBASE_NAME);
 
+	/* 设备已经注销，不会再有新的映射，已有的映射持有模块引用，所以这里可以直接释放 */
+	vfree(chrdevbase.ring);
+
 	printk("chrdevbase_exit\r\n");
 }
 
@@ -147,4 +507,4 @@ module_init(chrdevbase_init);   /* 注册模块加载函数 */
 module_exit(chrdevbase_exit);   /* 注册模块卸载函数 */
 
 MODULE_LICENSE("GPL");   /* 需要在驱动中加入LICENSE信息，必须添加否则会报错 */
-MODULE_AUTHOR("CVVO");   /* 添加模块作者信息 */
\ No newline at end of file
+MODULE_AUTHOR("CVVO");   /* 添加模块作者信息 */
@@ -1,5 +1,5 @@
 #!/bin/bash
 make clean
 make
-arm-linux-gnueabihf-gcc chrdevbaseApp.c -o chrdevbaseApp
+arm-linux-gnueabihf-gcc chrdevbaseAPP.c -o chrdevbaseAPP
 sudo cp chrdevbase.ko chrdevbaseAPP /home/cvvo/linux/nfs/rootfs/lib/modules/4.1.15/ -f
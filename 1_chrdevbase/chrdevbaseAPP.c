@@ -1,3 +1,4 @@
+#define _GNU_SOURCE		/* splice */
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -5,6 +6,10 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 
 /* 字符设备应用开发 */
 /*
@@ -12,13 +17,108 @@
  * @param - argc 	: argv数组元素个数，应用程序参数个数，如使用 ls -l：argv=2，argv为字符串 
  * @param - argv[] 	: 具体参数
  * @return 			: 0 成功;其他 失败
- * 使用方法 ./chrdevbaseAPP /dev/chrdevbase <1>|<2>
+ * 使用方法 ./chrdevbaseAPP /dev/chrdevbase <1>|<2>|<3>
   			 argv[2] 1:读文件
-  			 argv[2] 2:写文件	
+  			 argv[2] 2:写文件
+  			 argv[2] 3:通过mmap直接从环形缓冲区读取数据
+  			 argv[2] 4:用writev一次写入多段数据
+  			 argv[2] 5:用splice把数据经过管道送到标准输出，不经过用户空间缓冲区
  */
 
+#define CHRDEVBASE_SYNC_CMD	(_IO(0XEE, 0x1))	/* 通过mmap修改了head/tail之后，唤醒等待的读写进程 */
+
+/* 环形缓冲区控制页，和驱动中的定义一致 */
+struct chrdevbase_ring {
+	unsigned int size;			/* 数据区大小，2的幂 */
+	unsigned int data_offset;	/* 数据区相对映射起始地址的偏移 */
+	unsigned int head;			/* 写位置 */
+	unsigned int tail;			/* 读位置 */
+};
+
 static char usrdata[] = {"usr data!"};
 
+/*
+ * @description		: 通过mmap读取环形缓冲区中的数据，不经过read系统调用拷贝
+ * @param - fd 		: 文件描述符
+ * @return 			: 0 成功;其他 失败
+ */
+static int mmap_read(int fd)
+{
+    struct chrdevbase_ring *ring;
+    struct pollfd fds;
+    unsigned int size, head, tail, i;
+    char *data;
+    long pagesize = sysconf(_SC_PAGESIZE);
+
+    /* 先映射控制页得到数据区大小，再映射整个缓冲区 */
+    ring = mmap(NULL, pagesize, PROT_READ, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        printf("mmap failed!\r\n");
+        return -1;
+    }
+    size = ring->size;
+    munmap(ring, pagesize);
+
+    ring = mmap(NULL, pagesize + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        printf("mmap failed!\r\n");
+        return -1;
+    }
+    data = (char *)ring + ring->data_offset;
+
+    /* 等待数据 */
+    fds.fd = fd;
+    fds.events = POLLIN;
+    if (poll(&fds, 1, 5000) <= 0) {
+        printf("no data!\r\n");
+        munmap(ring, pagesize + size);
+        return -1;
+    }
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = ring->tail;
+    printf("usr mmap read %u bytes:", head - tail);
+    for (i = tail; i != head; i++)
+        putchar(data[i & (size - 1)]);
+    printf("\r\n");
+
+    /* 释放空间并通知驱动 */
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+    ioctl(fd, CHRDEVBASE_SYNC_CMD);
+
+    munmap(ring, pagesize + size);
+    return 0;
+}
+
+/*
+ * @description		: 通过管道把设备中的数据splice到标准输出
+ * @param - fd 		: 文件描述符
+ * @return 			: 0 成功;其他 失败
+ */
+static int splice_out(int fd)
+{
+    int pipefd[2];
+    ssize_t len;
+
+    if (pipe(pipefd) < 0) {
+        printf("pipe failed!\r\n");
+        return -1;
+    }
+
+    /* 设备 -> 管道 -> 标准输出，以非阻塞方式取走缓冲区中已有的数据 */
+    len = splice(fd, NULL, pipefd[1], NULL, 65536, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (len > 0)
+        len = splice(pipefd[0], NULL, STDOUT_FILENO, NULL, len, SPLICE_F_MOVE);
+    if (len < 0)
+        printf("splice failed!\r\n");
+    else
+        printf("\r\nusr splice %zd bytes\r\n", len);
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return len < 0 ? -1 : 0;
+}
+
 int main(int argc,char *argv[])  /* 主函数传参 */
 {   
     int fd=0,retvalue=0;
@@ -48,20 +148,44 @@ int main(int argc,char *argv[])  /* 主函数传参 */
         if(retvalue < 0){
 		    printf("read file %s failed!\r\n", filename);
 	    }else{
-			/* 读取成功，打印出读取成功的数据 */
-		    printf("usr read data:%s\r\n",readbuf);
+			/* 读取成功，打印出读取成功的数据，驱动只返回缓冲区中已有的数据 */
+		    printf("usr read %d bytes:%.*s\r\n",retvalue,retvalue,readbuf);
 	    }
     }
 
     if (atoi(argv[2])==2){
     /* 向设备驱动写数据 */
         memcpy(writebuf,usrdata,sizeof(usrdata));
-        retvalue=write(fd,writebuf,100); /*函数原型为ssize_t write(int fd, const void *buf, size_t count),fd:open函数打开文件成功后的文件描述符
+        retvalue=write(fd,writebuf,sizeof(usrdata)); /*函数原型为ssize_t write(int fd, const void *buf, size_t count),fd:open函数打开文件成功后的文件描述符
                         buf:要写入的数据，count:要写入的数据长度，也就是字节数，返回写入的字节数，返回 0 表示没有写入任何数据；如果返回负值，表示写入失败*/
         if(retvalue < 0){
 		    printf("write file %s failed!\r\n", filename);
+	    }else{
+		    printf("usr write %d bytes\r\n",retvalue);   /* 缓冲区快满时可能只写入一部分 */
+	    }
+    }
+
+    if (atoi(argv[2])==3){
+        mmap_read(fd);
+    }
+
+    if (atoi(argv[2])==4){
+        /* 两段数据通过一次系统调用写入 */
+        struct iovec iov[2] = {
+            { .iov_base = usrdata, .iov_len = sizeof(usrdata) - 1 },
+            { .iov_base = "\n", .iov_len = 1 },
+        };
+        retvalue = writev(fd, iov, 2);
+        if(retvalue < 0){
+		    printf("writev file %s failed!\r\n", filename);
+	    }else{
+		    printf("usr writev %d bytes\r\n",retvalue);
 	    }
     }
+
+    if (atoi(argv[2])==5){
+        splice_out(fd);
+    }
     
     /* 关闭设备 */
     retvalue=close(fd);     /*函数原型为int close(int fd)，fd：要关闭的文件描述符，返回值： 0 表示关闭成功，负值表示关闭失败*/
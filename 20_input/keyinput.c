@@ -4,6 +4,7 @@
 #include <linux/ide.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/errno.h>
 #include <linux/gpio.h>
 #include <linux/cdev.h>
@@ -11,11 +12,20 @@
 #include <linux/of.h>
 #include <linux/of_address.h>
 #include <linux/of_gpio.h>
+#include <linux/platform_device.h>
+#include <linux/pm_wakeup.h>
 #include <linux/input.h>
+#include <linux/input/matrix_keypad.h>
+#include <linux/slab.h>
 #include <linux/semaphore.h>
 #include <linux/timer.h>
 #include <linux/of_irq.h>
 #include <linux/irq.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/bitmap.h>
+#include <linux/spinlock.h>
 #include <asm/mach/map.h>
 #include <asm/uaccess.h>
 #include <asm/io.h>
@@ -24,180 +34,516 @@
 #define KEYINPUT_NAME  "keyinput"   /* 设备名字 */
 
 /* 定义按键值 */
-#define KEY_NUM     1                   /* 按键数量 	*/
+#define KEY_SCAN_DELAY_US	5				/* 矩阵扫描时拉低行线后等待电平稳定的时间 */
 
-/* 中断IO描述结构体 */
+/* 按键描述结构体，独立按键每个按键一个，矩阵键盘每一列一个(列线产生中断) */
 struct irq_keydesc{
 	int gpio_key;   /* gpio编号 */
+	bool active_low;	/* 低电平表示按下 */
 	int irqnum;   /* 中断号     */
-	unsigned char value;  /* 按键对应的键值 */
-	char name[10];   /* 中断名字 */
-	irqreturn_t (*handler) (int, void *);    /* 中断服务函数 */
+	const char *name;   /* 中断名字，设备树中有label时使用label */
+	unsigned int debounce_us;	/* 这个按键的消抖时间，单位us */
+	struct list_head node;	/* 挂在消抖链表上，不在链表上时指向自己 */
+	ktime_t deadline;		/* 消抖结束的时间 */
 };
 
 /* timer设备结构体 */
 struct keyinput_dev{
+	struct device *parent;	/* platform设备，用于唤醒统计 */
+	bool suspended;	/* 系统休眠中，这时的按键中断就是唤醒原因 */
 	struct device_node *nd;   /* 设备都是以节点的形式“挂”到设备树上的，因此要想获取这个设备的其他属性信息，必须先获取到这个设备的节点。
 							 Linux内核使用device_node结构体来描述一个节点 */ 
 
-	int timerperiod;   /* 定时周期，单位为ms，系统频率为100 Hz */
-	struct timer_list timer;  /* 定义一个定时器 */
+	struct hrtimer timer;  /* 所有按键共用一个消抖定时器，到期时间为消抖链表中最早的到期时间 */
+	spinlock_t lock;	/* 保护消抖链表和按键状态 */
+	struct list_head pending;	/* 正在消抖的按键，按到期时间排序，定时器只处理这些按键 */
 
-	struct irq_keydesc irqkeydesc[KEY_NUM]; /* 按键描述结构体数组,开发板上只有一个按键，因此irqkeydesc数组只有一个元素*/  
-
-	unsigned char curkeynum;	/* 当前的按键号 */
+	struct irq_keydesc *irqkeydesc; /* 按键描述结构体数组，矩阵键盘时为每一列，按键数量由设备树决定 */
+	int nkeys;	/* irqkeydesc的数量 */
+	int *row_gpios;	/* 矩阵键盘的行线 */
+	int nrows;	/* 行数，0表示独立按键 */
+	int ncols;	/* 列数，独立按键时等于按键数量 */
+	unsigned long *keystate;	/* 每个按键上次上报的状态，1为按下 */
 
 	struct input_dev *keyinput;  /* input结构体变量 */
-	
+	unsigned short *keycodes;	/* 按键编号到键值的映射，来自设备树linux,code或linux,keymap，可以通过EVIOCSKEYCODE修改 */
+	int nkeycodes;	/* 按键总数，矩阵键盘为行数x列数 */
+
 };
 
 struct keyinput_dev keyinput;
 
+/* 默认消抖时间，单位us，设备树中没有debounce-interval(独立按键)或debounce-delay-ms(矩阵键盘)时使用 */
+static unsigned int debounce_us = 5000;
+module_param(debounce_us, uint, 0444);
+MODULE_PARM_DESC(debounce_us, "Key debounce window in microseconds");
+
+/* 前沿消抖：第一个边沿立即上报，之后debounce_us内忽略抖动，窗口结束时再确认一次电平。
+ * 默认为后沿消抖：最后一个边沿之后稳定debounce_us才上报 */
+static bool debounce_leading;
+module_param(debounce_leading, bool, 0444);
+MODULE_PARM_DESC(debounce_leading, "Report on the first edge and ignore bounces for debounce_us");
+
+/*
+ * @description		: 计算消抖窗口结束的时间，窗口至少1us，
+ *					  保证定时器中重新加入链表的按键不会在同一次处理中到期
+ * @param - keydesc : 按键描述结构体
+ * @return 			: 到期时间
+ */
+static ktime_t key_deadline(struct irq_keydesc *keydesc)
+{
+	return ktime_add_us(ktime_get(),keydesc->debounce_us ? keydesc->debounce_us : 1);
+}
+
+/*
+ * @description		: 把按键按到期时间插入消抖链表。每个按键的消抖时间可以不同，
+ *					  从尾部往前找插入位置，消抖时间相同的按键总是直接加在尾部
+ * @param - dev 	: 设备
+ * @param - keydesc : 按键描述结构体
+ * @return 			: true 这个按键成为最早到期的，需要重新设置定时器
+ */
+static bool key_pending_add(struct keyinput_dev *dev,struct irq_keydesc *keydesc)
+{
+	struct irq_keydesc *pos;
+
+	list_del_init(&keydesc->node);
+	keydesc->deadline=key_deadline(keydesc);
+	list_for_each_entry_reverse(pos,&dev->pending,node){
+		if(!ktime_after(pos->deadline,keydesc->deadline)){
+			break;
+		}
+	}
+	list_add(&keydesc->node,&pos->node);   /* 没找到时pos->node就是链表头，加在最前面 */
+	return dev->pending.next==&keydesc->node;
+}
+
+
+/*
+ * @description		: 上报一个按键事件，扫描码为按键编号，键值由keycodes表决定
+ * @param - dev 	: 设备
+ * @param - key 	: 按键编号
+ * @param - pressed : 1 按下;0 松开
+ * @return 			: 无
+ */
+static void key_report(struct keyinput_dev *dev,int key,int pressed)
+{
+	input_event(dev->keyinput,EV_MSC,MSC_SCAN,key);
+	input_report_key(dev->keyinput,dev->keycodes[key],pressed); /* 最后一个参数表示按下还是松开，1为按下，0为松开 */
+}
+
+/*
+ * @description		: 一批按键事件上报完成，只同步一次
+ * @param - dev 	: 设备
+ * @return 			: 无
+ */
+static void key_report_sync(struct keyinput_dev *dev)
+{
+	input_sync(dev->keyinput);
+}
+
+/*
+ * @description		: 比较按键的新状态和上次上报的状态，变化时上报
+ * @param - dev 	: 设备
+ * @param - key 	: 按键编号，矩阵键盘为 行号x列数+列号
+ * @param - pressed : 1 按下;0 松开
+ * @return 			: 1 状态变化;0 没有变化
+ */
+static int key_update(struct keyinput_dev *dev,int key,int pressed)
+{
+	if(pressed==test_bit(key,dev->keystate)){
+		return 0;
+	}
+	__change_bit(key,dev->keystate);
+	key_report(dev,key,pressed);
+	return 1;
+}
 
-/* @description		: 中断服务函数，开启定时器，延时10ms，
- *				  	  定时器用于按键消抖。
+/*
+ * @description		: 消抖结束后读取按键状态，矩阵键盘逐行扫描这一列
+ * @param - dev 	: 设备
+ * @param - keydesc : 按键描述结构体
+ * @return 			: 状态变化的按键数量
+ */
+static int key_scan(struct keyinput_dev *dev,struct irq_keydesc *keydesc)
+{
+	int col=keydesc-dev->irqkeydesc;
+	int r,pressed,changed=0;
+
+	if(dev->nrows==0){   /* 独立按键，有效电平由设备树中的GPIO标志决定 */
+		return key_update(dev,col,(gpio_get_value(keydesc->gpio_key)!=0)^keydesc->active_low);
+	}
+
+	/* 矩阵键盘：先释放所有行线，再逐行拉低，读取这一列。
+	 * 按下的按键在扫描时会在列线上产生边沿，按住不放时每个消抖周期会重新扫描一次，状态不变不会上报 */
+	for(r=0;r<dev->nrows;r++){
+		gpio_direction_input(dev->row_gpios[r]);
+	}
+	for(r=0;r<dev->nrows;r++){
+		gpio_direction_output(dev->row_gpios[r],0);
+		udelay(KEY_SCAN_DELAY_US);
+		pressed=gpio_get_value(keydesc->gpio_key)==0;
+		gpio_direction_input(dev->row_gpios[r]);
+		changed+=key_update(dev,r*dev->ncols+col,pressed);
+	}
+	/* 所有行线恢复为低电平，任何按键按下都会在列线上产生中断 */
+	for(r=0;r<dev->nrows;r++){
+		gpio_direction_output(dev->row_gpios[r],0);
+	}
+	return changed;
+}
+
+/*
+ * @description		: 按键唤醒了系统。休眠期间的按键可能在消抖完成之前就已经松开，
+ *					  独立按键直接上报一次按下，之后的消抖会在松开时上报释放；
+ *					  矩阵键盘不知道是哪一行，立即扫描一次这一列。调用者持有lock
+ * @param - dev 	: 设备
+ * @param - keydesc : 唤醒系统的按键
+ * @return 			: 无
+ */
+static void key_wakeup(struct keyinput_dev *dev,struct irq_keydesc *keydesc)
+{
+	int key=keydesc-dev->irqkeydesc;
+
+	printk("wakeup by %s\r\n",keydesc->name);
+	pm_wakeup_event(dev->parent,0);   /* 计入/sys/kernel/debug/wakeup_sources */
+	if(dev->nrows){
+		if(key_scan(dev,keydesc)){
+			key_report_sync(dev);
+		}
+		return;
+	}
+	if(test_bit(key,dev->keystate)){   /* 休眠之前就是按下状态 */
+		return;
+	}
+	__set_bit(key,dev->keystate);
+	key_report(dev,key,1);
+	key_report_sync(dev);
+}
+
+/* @description		: 中断服务函数，把按键加入消抖链表。所有按键共用一个hrtimer，
+ *				  	  后沿消抖时，窗口内再次产生的中断只会推迟这个按键的到期时间；
+ *				  	  前沿消抖时，第一个边沿直接上报，窗口内的中断被忽略。
  * @param - irq 	: 中断号 
- * @param - dev_id	: 设备结构。
+ * @param - dev_id	: 按键描述结构体
  * @return 			: 中断执行结果
  */
-static irqreturn_t key0_handler(int irq, void *dev_id)
+static irqreturn_t key_handler(int irq, void *dev_id)
 {	
-	struct keyinput_dev *dev=(struct keyinput_dev *)dev_id;
-	dev->curkeynum=0;
-	/* 开启定时器 */
-	dev->timer.data=(unsigned long)dev;  /* 设置要传递给function函数的参数 */
-	mod_timer(&dev->timer,jiffies+msecs_to_jiffies(dev->timerperiod));
+	struct irq_keydesc *keydesc=dev_id;
+	struct keyinput_dev *dev=&keyinput;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->lock,flags);
+	if(dev->suspended){   /* 休眠时产生的中断，这个按键唤醒了系统 */
+		key_wakeup(dev,keydesc);
+	}
+	if(debounce_leading){
+		if(!list_empty(&keydesc->node)){   /* 还在消抖窗口内，是抖动，忽略 */
+			spin_unlock_irqrestore(&dev->lock,flags);
+			return IRQ_RETVAL(IRQ_HANDLED);
+		}
+		/* 第一个边沿，立即读取电平并上报，不等待消抖 */
+		if(key_scan(dev,keydesc)){
+			key_report_sync(dev);
+		}
+	}
+	if(key_pending_add(dev,keydesc)){   /* 最早到期的按键变了，重新设置定时器 */
+		hrtimer_start(&dev->timer,keydesc->deadline,HRTIMER_MODE_ABS);
+	}
+	spin_unlock_irqrestore(&dev->lock,flags);
 
 	return IRQ_RETVAL(IRQ_HANDLED);
 	
 }
 
+/* @description	: 定时器服务函数，处理消抖链表中所有已经到期的按键，
+ *				  只访问正在消抖的按键，按键再多也只有一个定时器。
+ * @param - timer	: 定时器
+ * @return 		: 是否重新启动定时器
+ */
+static enum hrtimer_restart key_timer_function(struct hrtimer *timer)
+{
+	struct keyinput_dev *dev=container_of(timer,struct keyinput_dev,timer);
+	struct irq_keydesc *keydesc;
+	enum hrtimer_restart ret=HRTIMER_NORESTART;
+	ktime_t now=ktime_get();
+	unsigned long flags;
+	int changed=0;
+
+	spin_lock_irqsave(&dev->lock,flags);
+	while(!list_empty(&dev->pending)){
+		keydesc=list_first_entry(&dev->pending,struct irq_keydesc,node);
+		if(ktime_after(keydesc->deadline,now)){   /* 后面的按键都还没到期 */
+			break;
+		}
+		list_del_init(&keydesc->node);
+		if(key_scan(dev,keydesc)){
+			changed++;
+			if(debounce_leading){   /* 窗口内电平又变了，上报后重新开始一个消抖窗口 */
+				key_pending_add(dev,keydesc);
+			}
+		}
+	}
+	if(changed){   /* 一批按键处理完后统一通知 */
+		key_report_sync(dev);
+	}
+	if(!list_empty(&dev->pending)){   /* 定时到下一个按键的到期时间 */
+		keydesc=list_first_entry(&dev->pending,struct irq_keydesc,node);
+		hrtimer_set_expires(timer,keydesc->deadline);
+		ret=HRTIMER_RESTART;
+	}
+	spin_unlock_irqrestore(&dev->lock,flags);
 
-/* static一般用于修饰局部变量，全局变量，函数 */
+	return ret;
+}
 
-/* @description	: 定时器服务函数，用于按键消抖，定时器到了以后
- *				  再次读取按键值，如果按键还是处于按下状态就表示按键有效。
- * @param - arg	: 设备结构变量
- * @return 		: 无
+/*
+ * @description : devm释放动作，删除消抖定时器。devm按申请的相反顺序释放资源，
+ *				  这个动作在申请中断之前注册，所以执行时中断已经释放，定时器不会再被启动
+ * @param - data : 设备
+ * @return : 无
+ */
+static void keyio_timer_cancel(void *data)
+{
+	struct keyinput_dev *dev=data;
+
+	hrtimer_cancel(&dev->timer);
+}
+
+/*
+ * @description : 解析设备树中的按键，支持三种写法：
+ *  1、gpio-keys风格，每个子节点一个按键：gpios、linux,code，可选label和debounce-interval(ms)
+ *  2、矩阵键盘：row-gpios、col-gpios和linux,keymap，可选debounce-delay-ms
+ *  3、key-gpios中的独立按键，按键0为KEY_0，其他按键依次使用BTN_TRIGGER_HAPPY之后的键值
+ *  只分配内存和读取属性，不申请GPIO和中断
+ * @param - pdev : platform设备
+ * @return : 0 成功;其他 失败
  */
-void timer_function(unsigned long arg)
+static int keyio_parse(struct platform_device *pdev)
 {
-	struct keyinput_dev *dev=(struct keyinput_dev *)arg;
-	unsigned char num,keyvalue;
+	struct keyinput_dev *dev=&keyinput;
+	struct device_node *child;
 	struct irq_keydesc *keydesc;
+	enum of_gpio_flags flags;
+	u32 val,ms;
+	int i,n,nrows,ncols;
+
+	/* 1、获取设备节点，就是和驱动匹配的节点 */
+	dev->parent=&pdev->dev;
+	dev->nd=pdev->dev.of_node;
+	if(dev->nd==NULL){
+		printk("key node not find!\r\n");
+		return -EINVAL;  /* 返回无效参数符号 */
+	}
+
+	/* 2、获取按键数量 */
+	nrows=of_gpio_named_count(dev->nd,"row-gpios");
+	ncols=of_gpio_named_count(dev->nd,"col-gpios");
+	if(nrows>0 && ncols>0){   /* 矩阵键盘，中断在列线上 */
+		dev->nkeys=ncols;
+	}else{
+		nrows=0;
+		dev->nkeys=of_get_child_count(dev->nd);
+		if(dev->nkeys<=0){   /* 没有子节点，使用key-gpios */
+			dev->nkeys=of_gpio_named_count(dev->nd,"key-gpios");
+		}
+		ncols=dev->nkeys;
+	}
+	if(dev->nkeys<=0){
+		printk("no keys in device tree!\r\n");
+		return -EINVAL;
+	}
+	dev->nrows=nrows;
+	dev->ncols=ncols;
+	dev->nkeycodes=nrows ? nrows*ncols : ncols;
+
+	/* 3、按键数量不固定，用devm分配，驱动移除时自动释放 */
+	dev->irqkeydesc=devm_kcalloc(&pdev->dev,dev->nkeys,sizeof(*dev->irqkeydesc),GFP_KERNEL);
+	dev->keycodes=devm_kcalloc(&pdev->dev,dev->nkeycodes,sizeof(*dev->keycodes),GFP_KERNEL);
+	dev->keystate=devm_kcalloc(&pdev->dev,BITS_TO_LONGS(dev->nkeycodes),sizeof(long),GFP_KERNEL);
+	dev->row_gpios=devm_kcalloc(&pdev->dev,nrows ? nrows : 1,sizeof(int),GFP_KERNEL);
+	if(!dev->irqkeydesc || !dev->keycodes || !dev->keystate || !dev->row_gpios){
+		return -ENOMEM;
+	}
 
-	num=dev->curkeynum;
-	keydesc=&dev->irqkeydesc[num];
-	keyvalue=gpio_get_value(keydesc->gpio_key);  /* 读取IO值 */
+	/* 4、每个按键的GPIO、键值、名字和消抖时间 */
+	if(nrows){   /* 矩阵键盘 */
+		val=of_property_read_u32(dev->nd,"debounce-delay-ms",&ms) ? debounce_us : ms*1000;   /* 所有列共用 */
+		for(i=0;i<nrows;i++){
+			dev->row_gpios[i]=of_get_named_gpio(dev->nd,"row-gpios",i);
+			if(dev->row_gpios[i]<0){
+				printk("can't get row-gpios %d!\r\n",i);
+				return -EINVAL;
+			}
+		}
+		for(i=0;i<ncols;i++){
+			keydesc=&dev->irqkeydesc[i];
+			keydesc->gpio_key=of_get_named_gpio(dev->nd,"col-gpios",i);
+			keydesc->active_low=true;   /* 行线拉低扫描，列线低电平表示按下 */
+			keydesc->name=devm_kasprintf(&pdev->dev,GFP_KERNEL,"KEYCOL%d",i);
+			keydesc->debounce_us=val;
+		}
+		/* linux,keymap每一项为 行号<<24 | 列号<<16 | 键值，没有写到的按键键值为KEY_RESERVED */
+		n=of_property_count_u32_elems(dev->nd,"linux,keymap");
+		if(n<=0){
+			printk("matrix keypad has no linux,keymap!\r\n");
+			return -EINVAL;
+		}
+		for(i=0;i<n;i++){
+			of_property_read_u32_index(dev->nd,"linux,keymap",i,&val);
+			if(KEY_ROW(val)>=nrows || KEY_COL(val)>=ncols || KEY_VAL(val)>KEY_MAX){
+				printk("linux,keymap entry %d out of range!\r\n",i);
+				return -EINVAL;
+			}
+			dev->keycodes[KEY_ROW(val)*ncols+KEY_COL(val)]=KEY_VAL(val);
+		}
+	}else if(of_get_child_count(dev->nd)>0){   /* gpio-keys风格 */
+		i=0;
+		for_each_child_of_node(dev->nd,child){
+			keydesc=&dev->irqkeydesc[i];
+			keydesc->gpio_key=of_get_named_gpio_flags(child,"gpios",0,&flags);
+			keydesc->active_low=flags & OF_GPIO_ACTIVE_LOW;
+			if(of_property_read_u32(child,"linux,code",&val) || val>KEY_MAX){   /* 键值超出范围会越界修改keybit */
+				printk("key %s has no valid linux,code!\r\n",child->name);
+				of_node_put(child);
+				return -EINVAL;
+			}
+			dev->keycodes[i]=val;
+			if(of_property_read_string(child,"label",&keydesc->name)){
+				keydesc->name=child->name;
+			}
+			keydesc->debounce_us=of_property_read_u32(child,"debounce-interval",&ms) ? debounce_us : ms*1000;
+			i++;
+		}
+	}else{   /* key-gpios */
+		for(i=0;i<ncols;i++){
+			keydesc=&dev->irqkeydesc[i];
+			keydesc->gpio_key=of_get_named_gpio(dev->nd,"key-gpios",i);
+			keydesc->active_low=true;
+			keydesc->name=devm_kasprintf(&pdev->dev,GFP_KERNEL,"KEY%d",i);
+			keydesc->debounce_us=debounce_us;
+			val=i ? BTN_TRIGGER_HAPPY1+i : KEY_0;
+			if(val>KEY_MAX){   /* BTN_TRIGGER_HAPPY之后的键值不够用，和linux,code一样检查 */
+				printk("too many key-gpios, key %d has no key code!\r\n",i);
+				return -EINVAL;
+			}
+			dev->keycodes[i]=val;
+		}
+	}
 
-	/* 上报事件 */
-	if(keyvalue==0){       /* 按下按键 */
-		input_report_key(dev->keyinput,KEY_0,1); /* 最后一个参数表示按下还是松开，1为按下，0为松开 */
-		input_sync(dev->keyinput);
-	}else{               /* 按键松开 */
-		input_report_key(dev->keyinput,KEY_0,0);
-		input_sync(dev->keyinput);
+	for(i=0;i<dev->nkeys;i++){
+		if(dev->irqkeydesc[i].gpio_key<0 || !dev->irqkeydesc[i].name){
+			printk("can't get key %d gpio!\r\n",i);
+			return -EINVAL;
+		}
 	}
+	return 0;
 }
 
  /*
-  * @description : 初始化按键 IO， open 函数打开驱动的时候
-  *  初始化按键所使用的 GPIO 引脚。
-  *  @param : 无
-  *  @return : 无
+  * @description : 初始化按键 IO，keyio_parse之后调用。
+  *  GPIO和中断都用devm接口申请，probe失败或者驱动移除时自动释放
+  *  @param - pdev : platform设备
+  *  @return : 0 成功;其他 失败
  */
-static int keyio_init(void)
+static int keyio_init(struct platform_device *pdev)
 {
+	struct keyinput_dev *dev=&keyinput;
+	struct irq_keydesc *keydesc;
 	int ret=0;
-	unsigned char i=0;
-
-	/* 设置key所使用的GPIO */
-	/* 1、获取设备节点：key */
-	keyinput.nd=of_find_node_by_path("/key"); /* 通过路径来查找指定的节点，path：带有全路径的节点名，可以使用节点的别名 */
-	if(keyinput.nd==NULL){
-		printk("key node not find!\r\n");
-		return -EINVAL;  /* 返回无效参数符号 */
-	}else{
-		printk("key node find!\r\n");
+	int i,irq;
+
+	/* 1、初始化消抖定时器和链表 */
+	spin_lock_init(&dev->lock);
+	INIT_LIST_HEAD(&dev->pending);
+	hrtimer_init(&dev->timer,CLOCK_MONOTONIC,HRTIMER_MODE_ABS);
+	dev->timer.function=key_timer_function;
+	ret=devm_add_action(&pdev->dev,keyio_timer_cancel,dev);
+	if(ret<0){
+		return ret;
 	}
 
-	/* 2、获取设备树中的gpio属性，得到key所使用的key编号*/
-	for(i=0;i<KEY_NUM;i++){
-		keyinput.irqkeydesc[i].gpio_key=of_get_named_gpio(keyinput.nd,"key-gpios",i); 
-		 /* 类似<&gpio5 7 GPIO_ACTIVE_LOW>的属性信息转换为对应的GPIO编号 */
-	/* 函数原型：int of_get_named_gpio(struct device_node *np,const char *propname,int index) */
-		if(keyinput.irqkeydesc[i].gpio_key<0){
-			printk("can't get key-gpios!\r\n");
-			return -EINVAL;  /* 返回无效参数符号 */
-		}else{
-			printk("key%d-gpios num=%d\r\n",i,keyinput.irqkeydesc[i].gpio_key);
+	/* 2、矩阵键盘的行线设置为输出低电平 */
+	for(i=0;i<dev->nrows;i++){
+		if(devm_gpio_request_one(&pdev->dev,dev->row_gpios[i],GPIOF_OUT_INIT_LOW,"keyrow")<0){
+			printk("key row%d io request fail!\r\n",i);
+			return -EINVAL;
 		}
 	}
 
-	/* 3、始化key所使用的IO，并且设置成中断模式 */
-	for(i=0;i<KEY_NUM;i++){
-		memset(keyinput.irqkeydesc[i].name,0,sizeof(keyinput.irqkeydesc[i].name));   /* memset一般使用“0”初始化内存单元,而且通常是给数组或结构体进行初始化 */
-		sprintf(keyinput.irqkeydesc[i].name,"KEY%d",i);
+	/* 3、初始化按键(列)所使用的IO，并且设置成中断模式 */
+	for(i=0;i<dev->nkeys;i++){
+		keydesc=&dev->irqkeydesc[i];
+		INIT_LIST_HEAD(&keydesc->node);
 
-		/* 申请IO，申请后能被其他设备检测，避免重复使用 */
-		ret=gpio_request(keyinput.irqkeydesc[i].gpio_key,keyinput.irqkeydesc[i].name);
-		/* 函数原型： int gpio_request(unsigned gpio, const char *label)*/
-		if(ret<0){
-			printk("key%d io request fail!\r\n",i);
-			return -EINVAL;  /* 返回无效参数符号 */
+		/* 申请IO并设置为输入，申请后能被其他设备检测，避免重复使用 */
+		if(devm_gpio_request_one(&pdev->dev,keydesc->gpio_key,GPIOF_IN,keydesc->name)<0){
+			printk("%s io request fail!\r\n",keydesc->name);
+			return -EINVAL;
+		}
+
+		/* 获取中断号，按键数量不固定，直接由GPIO得到中断号 */
+		irq=gpio_to_irq(keydesc->gpio_key);
+		if(irq<0){
+			printk("%s can't get irq!\r\n",keydesc->name);
+			return irq;
 		}
-		/* 设置key gpio为输入 */
-		ret=gpio_direction_input(keyinput.irqkeydesc[i].gpio_key);
-		/* 函数原型：int gpio_direction_input(unsigned gpio, int value) */
+		ret=devm_request_irq(&pdev->dev,irq,key_handler,IRQF_TRIGGER_RISING|IRQF_TRIGGER_FALLING,keydesc->name,keydesc);
 		if(ret<0){
-			printk("can't set key%d gpio!\r\n",i);
-			return -EINVAL;  /* 返回无效参数符号 */
+			printk("%s irq-%d request failed!\r\n",keydesc->name,irq);
+			return ret;
 		}
-		/* 获取中断号 */
-		keyinput.irqkeydesc[i].irqnum=irq_of_parse_and_map(keyinput.nd,i);
+		keydesc->irqnum=irq;
 
-		printk("key%d:gpio=%d, irqnum=%d\r\n",i,keyinput.irqkeydesc[i].gpio_key,keyinput.irqkeydesc[i].irqnum);
+		printk("%s:gpio=%d, irqnum=%d, debounce=%uus\r\n",keydesc->name,keydesc->gpio_key,keydesc->irqnum,keydesc->debounce_us);
 	}
 
-	/* 申请中断 */
-	keyinput.irqkeydesc[0].handler=key0_handler;
-	keyinput.irqkeydesc[0].value = KEY_0;
-	for(i=0;i<KEY_NUM;i++){
-		ret=request_irq(keyinput.irqkeydesc[i].irqnum,keyinput.irqkeydesc[i].handler, IRQF_TRIGGER_RISING|IRQF_TRIGGER_FALLING,
-						keyinput.irqkeydesc[i].name,&keyinput);
-		if(ret<0){
-			printk("key%d irq-%d request failed!\r\n",i,keyinput.irqkeydesc[i].irqnum);
-			return -EFAULT;
-		}
-	}
-
-	/* 创建定时器 */
-	init_timer(&keyinput.timer);
-	keyinput.timer.function=timer_function;
-	keyinput.timerperiod=10;        /* 定时周期为10ms */
-
-	/* 注册input_dev  */
-	/* 1、申请input_dev */
-	keyinput.keyinput=input_allocate_device();
-	keyinput.keyinput->name=KEYINPUT_NAME;
-
-	/* 2、初始化input_dev */
-#if 0
-	/* 第一种设置产生哪些事件*/
-	__set_bit(EV_KEY,keyinput.keyinput->evbit);   /* 设置产生按键事件 */
-	__set_bit(EV_REP,keyinput.keyinput->evbit);   /* 重复事件，比如按下去不放开，就会一直输出信息 */
-	/* 初始化input_dev，设置产生哪些按键 */
-	__set_bit(KEY_0,keyinput.keyinput->keybit); 
- 
-	/* 第二种 */
-	keyinput.keyinput->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_REP);   /* BIT_MASK和 BIT_WORD？？？*/
-	keyinput.keyinput->keybit[BIT_WORD(KEY_0)] |= BIT_MASK(KEY_0); 
-#endif                                  /* BIT_WORD查看对应的位图为第几个32位，如nr=35,BIT_WORD(35)=35/32=1 */
-										/* BIT_MASK(nr),nr=35,=1<<(35%32)——综上所述：addr[1]|=1<<3 */
-	/* 第三种 */
-	keyinput.keyinput->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_REP);
-	input_set_capability(keyinput.keyinput, EV_KEY, KEY_0);   /* input_set_capability——设置输入设备各种能力
+	printk("%d keys, %s\r\n",dev->nkeycodes,dev->nrows ? "matrix" : "direct");
+	return 0;
+}
+
+/*
+ * @description		: platform驱动的probe函数，当驱动与设备匹配以后此函数就会执行
+ * @param - pdev 	: platform设备
+ * @return 			: 0，成功;其他负值,失败
+ */
+static int keyinput_probe(struct platform_device *pdev)
+{	
+	int ret=0;
+	int i;
+	printk("key driver and device has matched!\r\n");
+
+	/* 1、从设备树获取按键和键值 */
+	ret=keyio_parse(pdev);
+	if(ret<0){
+		return ret;
+	}
+
+	/* 2、申请input_dev，必须在申请中断之前注册完成。使用devm接口，驱动移除时在中断释放之后自动注销 */
+	keyinput.keyinput=devm_input_allocate_device(&pdev->dev);
+	if(!keyinput.keyinput){
+		return -ENOMEM;
+	}
+	if(of_property_read_string(pdev->dev.of_node,"label",&keyinput.keyinput->name)){
+		keyinput.keyinput->name=KEYINPUT_NAME;
+	}
+	keyinput.keyinput->phys="keyinput/input0";
+	keyinput.keyinput->id.bustype=BUS_HOST;
+
+	/* 3、初始化input_dev，只声明设备树中用到的键值。
+	 * EV_REP由input子系统实现软件连发，延时和周期可以通过EVIOCSREP修改 */
+	__set_bit(EV_KEY,keyinput.keyinput->evbit);
+	__set_bit(EV_REP,keyinput.keyinput->evbit);
+	for(i=0;i<keyinput.nkeycodes;i++){
+		if(keyinput.keycodes[i]!=KEY_RESERVED){
+			input_set_capability(keyinput.keyinput, EV_KEY, keyinput.keycodes[i]);   /* input_set_capability——设置输入设备各种能力
 						void input_set_capability(struct input_dev *dev, unsigned int type, unsigned int code); */
+		}
+	}
+	input_set_capability(keyinput.keyinput, EV_MSC, MSC_SCAN);
+	keyinput.keyinput->keycode=keyinput.keycodes;
+	keyinput.keyinput->keycodesize=sizeof(keyinput.keycodes[0]);
+	keyinput.keyinput->keycodemax=keyinput.nkeycodes;
 
 	ret=input_register_device(keyinput.keyinput);
 	if(ret<0){
@@ -205,39 +551,115 @@ static int keyio_init(void)
 		return ret;
 	}
 
-	return ret;
-}
-
-/* 驱动入口 */
-static int __init keyinput_init(void)
-{	
-	int ret=0;
-	ret=keyio_init();   /* 初始化ledio */
+	/* 4、初始化按键IO和中断 */
+	ret=keyio_init(pdev);
 	if(ret<0){
 		return ret;
 	}
+
+	/* 按键可以唤醒系统，设备树中有wakeup-source时默认开启，也可以通过sysfs的power/wakeup修改 */
+	device_set_wakeup_capable(&pdev->dev,true);
+	device_set_wakeup_enable(&pdev->dev,of_property_read_bool(pdev->dev.of_node,"wakeup-source"));
+
 	return 0;
 }
 
-/* 驱动出口 */
-static void __exit keyinput_exit(void)
+/*
+ * @description		: platform驱动的remove函数，移除platform驱动的时候此函数会执行，
+ *					  中断、定时器、GPIO和input_dev由devm在此函数返回后释放
+ * @param - pdev 	: platform设备
+ * @return 			: 0，成功;其他负值,失败
+ */
+static int keyinput_remove(struct platform_device *pdev)
 {
-	unsigned char i=0;
-	del_timer_sync(&keyinput.timer);	/* 删除timer定时期 */
+	device_init_wakeup(&pdev->dev,false);
+	printk("key remove\r\n");
+	return 0;
+}
 
-	/* 释放中断 */
-	for(i=0;i<KEY_NUM;i++){
-		free_irq(keyinput.irqkeydesc[i].irqnum,&keyinput);  /* dev为指针参数，不需要取址符号& */
-		/* 释放IO,申请和释放配合使用 */
-		gpio_free(keyinput.irqkeydesc[i].gpio_key);
+#ifdef CONFIG_PM_SLEEP
+/*
+ * @description		: 系统休眠，允许唤醒时把所有按键中断设置为唤醒中断
+ * @param - d 		: platform设备中的device
+ * @return 			: 0 成功;其他 失败
+ */
+static int keyinput_suspend(struct device *d)
+{
+	struct keyinput_dev *dev=&keyinput;
+	int i;
+
+	if(!device_may_wakeup(d)){   /* 通过设备树wakeup-source或者sysfs的power/wakeup设置 */
+		return 0;
+	}
+	dev->suspended=true;
+	for(i=0;i<dev->nkeys;i++){
+		if(enable_irq_wake(dev->irqkeydesc[i].irqnum)<0){
+			printk("%s can't wake up the system!\r\n",dev->irqkeydesc[i].name);
+		}
 	}
+	return 0;
+}
 
-	/* 释放input_dev */
-	input_unregister_device(keyinput.keyinput);
-	input_free_device(keyinput.keyinput);
+/*
+ * @description		: 系统唤醒，恢复按键中断。唤醒系统的中断在此之前已经重新执行，
+ *					  唤醒系统的按键已经在中断中上报
+ * @param - d 		: platform设备中的device
+ * @return 			: 0 成功;其他 失败
+ */
+static int keyinput_resume(struct device *d)
+{
+	struct keyinput_dev *dev=&keyinput;
+	int i;
 
-	printk("timer_exit\r\n");
+	if(!dev->suspended){
+		return 0;
+	}
+	for(i=0;i<dev->nkeys;i++){
+		disable_irq_wake(dev->irqkeydesc[i].irqnum);
+	}
+	dev->suspended=false;
+	return 0;
+}
+#endif
+
+/* 电源管理函数 */
+static SIMPLE_DEV_PM_OPS(keyinput_pm_ops,keyinput_suspend,keyinput_resume);
+
+static struct of_device_id keyinput_of_match[]={   /* 需要包括最后一个空元素 */
+	{.compatible="mytest_key"},
+	{/* Sentinel */}
+};
+MODULE_DEVICE_TABLE(of, keyinput_of_match);
+
+/* platform驱动结构体 */
+static struct platform_driver keyinput_driver={
+	.driver={
+		.name="My_imx6ul_keyinput",   /* 驱动名字，用于和设备匹配 */
+		.of_match_table=keyinput_of_match,
+		.pm=&keyinput_pm_ops,
+	},
+	.probe=keyinput_probe,
+	.remove=keyinput_remove,
+};
+
+/*
+ * @description	: 驱动模块加载函数
+ * @param 		: 无
+ * @return 		: 无
+ */
+static int __init keyinput_init(void)
+{
+	return platform_driver_register(&keyinput_driver);
+}
 
+/*
+ * @description	: 驱动模块卸载函数
+ * @param 		: 无
+ * @return 		: 无
+ */
+static void __exit keyinput_exit(void)
+{
+	platform_driver_unregister(&keyinput_driver);
 }
 
 /* 注册驱动加载和卸载 */
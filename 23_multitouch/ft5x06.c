@@ -36,6 +36,22 @@ Copyright © ALIENTEK Co., Ltd. 1998-2029. All rights reserved.
 #define FT5426_IDG_MODE_REG		0XA4		/* 中断模式				*/
 #define FT5X06_READLEN			29			/* 要读取的寄存器个数 	*/
 
+/* 触摸坐标滤波相关宏定义，滤波器内部使用Q8定点数 */
+#define FT5X06_FILTER_SHIFT		8			/* 定点小数位数 		*/
+#define FT5X06_FILTER_ONE		(1 << FT5X06_FILTER_SHIFT)
+#define FT5X06_FILTER_WEIGHT	96			/* 默认IIR权重，256表示不滤波 	*/
+#define FT5X06_FILTER_DEADBAND	2			/* 默认死区，单位像素 	*/
+#define FT5X06_FILTER_FAST		24			/* 默认快速移动阈值，单位像素 	*/
+#define FT5X06_FILTER_DEADBAND_MAX	64		/* 死区的最大值 		*/
+#define FT5X06_FILTER_FAST_MAX	1024		/* 快速移动阈值的最大值 	*/
+
+/* 每个触摸点(slot)的滤波状态 */
+struct ft5x06_filter {
+	bool active;							/* 该slot是否处于按下状态 	*/
+	int fx, fy;								/* 滤波后的坐标，Q8定点 	*/
+	int rx, ry;								/* 上次上报的坐标 		*/
+};
+
 struct ft5x06_dev {
 	struct device_node	*nd; 				/* 设备节点 		*/
 	int irq_pin,reset_pin;					/* 中断和复位IO		*/
@@ -43,6 +59,12 @@ struct ft5x06_dev {
 	void *private_data;						/* 私有数据 		*/
 	struct input_dev *input;				/* input结构体 		*/
 	struct i2c_client *client;				/* I2C客户端 		*/
+
+	/* 坐标滤波参数，0表示关闭对应功能，可通过设备树和sysfs配置 */
+	unsigned int filter_weight;				/* IIR权重(1~256) 	*/
+	unsigned int filter_deadband;			/* 死区，单位像素 	*/
+	unsigned int filter_fast;				/* 超过此位移直接跟随 	*/
+	struct ft5x06_filter filter[MAX_SUPPORT_POINTS];	/* 每个slot的滤波状态 */
 };
 
 static struct ft5x06_dev ft5x06;
@@ -150,6 +172,58 @@ static void ft5x06_write_reg(struct ft5x06_dev *dev, u8 reg, u8 data)
 	ft5x06_write_regs(dev, reg, &buf, 1);
 }
 
+/*
+ * @description		: 对一个触摸点坐标进行滤波，先做IIR低通滤波，然后和上次
+ *					  上报的坐标比较，位移在死区内的话就不上报，这样手指静止
+ *					  时不会产生大量抖动事件。位移超过快速阈值的时候直接跟随
+ *					  原始坐标，保证快速滑动时没有滞后。
+ * @param - dev		: ft5x06设备
+ * @param - f		: 该slot的滤波状态
+ * @param - x		: 输入原始X坐标，输出滤波后的X坐标
+ * @param - y		: 输入原始Y坐标，输出滤波后的Y坐标
+ * @return			: true，需要上报;false，坐标在死区内，不需要上报
+ */
+static bool ft5x06_filter_point(struct ft5x06_dev *dev, struct ft5x06_filter *f,
+				int *x, int *y)
+{
+	unsigned int weight = dev->filter_weight;
+	int dx, dy;
+
+	/* 刚按下，直接使用原始坐标初始化滤波器 */
+	if (!f->active) {
+		f->active = true;
+		f->fx = *x << FT5X06_FILTER_SHIFT;
+		f->fy = *y << FT5X06_FILTER_SHIFT;
+		f->rx = *x;
+		f->ry = *y;
+		return true;
+	}
+
+	/* 快速移动时不滤波，直接跟随 */
+	if (dev->filter_fast && (abs(*x - f->rx) > dev->filter_fast ||
+			abs(*y - f->ry) > dev->filter_fast))
+		weight = FT5X06_FILTER_ONE;
+
+	/* IIR低通滤波：f = f + (raw - f) * weight / 256 */
+	if (weight == 0 || weight > FT5X06_FILTER_ONE)
+		weight = FT5X06_FILTER_ONE;
+	f->fx += (((*x << FT5X06_FILTER_SHIFT) - f->fx) * (int)weight) >> FT5X06_FILTER_SHIFT;
+	f->fy += (((*y << FT5X06_FILTER_SHIFT) - f->fy) * (int)weight) >> FT5X06_FILTER_SHIFT;
+
+	*x = (f->fx + FT5X06_FILTER_ONE / 2) >> FT5X06_FILTER_SHIFT;
+	*y = (f->fy + FT5X06_FILTER_ONE / 2) >> FT5X06_FILTER_SHIFT;
+
+	/* 死区判断，位移太小的话不上报 */
+	dx = abs(*x - f->rx);
+	dy = abs(*y - f->ry);
+	if (dx <= dev->filter_deadband && dy <= dev->filter_deadband)
+		return false;
+
+	f->rx = *x;
+	f->ry = *y;
+	return true;
+}
+
 /*
  * @description     : FT5X06中断服务函数
  * @param - irq 	: 中断号 
@@ -199,12 +273,20 @@ static irqreturn_t ft5x06_handler(int irq, void *dev_id)
 		 * bit3:0  Y轴触摸点的11~8位。
 		 */
 		id = (buf[2] >> 4) & 0x0f;
+		if (id >= MAX_SUPPORT_POINTS)
+			continue;
 		down = type != TOUCH_EVENT_UP;
 
 		input_mt_slot(multidata->input, id);
 		input_mt_report_slot_state(multidata->input, MT_TOOL_FINGER, down);
 
-		if (!down)
+		if (!down) {
+			multidata->filter[id].active = false;	/* 抬起，复位滤波器 */
+			continue;
+		}
+
+		/* 坐标滤波，在死区内的抖动不上报 */
+		if (!ft5x06_filter_point(multidata, &multidata->filter[id], &x, &y))
 			continue;
 
 		input_report_abs(multidata->input, ABS_MT_POSITION_X, x);
@@ -219,6 +301,73 @@ fail:
 
 }
 
+/*
+ * @description	: sysfs读写滤波参数，对应文件为filter_weight、filter_deadband
+ *				  和filter_fast，位于i2c设备目录下
+ */
+#define FT5X06_FILTER_ATTR(_name, _max) \
+static ssize_t _name##_show(struct device *dev, \
+			     struct device_attribute *attr, char *buf) \
+{ \
+	return sprintf(buf, "%u\n", ft5x06._name); \
+} \
+static ssize_t _name##_store(struct device *dev, \
+			      struct device_attribute *attr, const char *buf, size_t count) \
+{ \
+	unsigned int val; \
+	int ret; \
+ \
+	ret = kstrtouint(buf, 0, &val); \
+	if (ret) \
+		return ret; \
+	if (val > (_max)) \
+		return -EINVAL; \
+	ft5x06._name = val; \
+	return count; \
+} \
+static DEVICE_ATTR_RW(_name)
+
+FT5X06_FILTER_ATTR(filter_weight, FT5X06_FILTER_ONE);
+FT5X06_FILTER_ATTR(filter_deadband, FT5X06_FILTER_DEADBAND_MAX);
+FT5X06_FILTER_ATTR(filter_fast, FT5X06_FILTER_FAST_MAX);
+
+static struct attribute *ft5x06_attrs[] = {
+	&dev_attr_filter_weight.attr,
+	&dev_attr_filter_deadband.attr,
+	&dev_attr_filter_fast.attr,
+	NULL
+};
+
+static const struct attribute_group ft5x06_attr_group = {
+	.attrs = ft5x06_attrs,
+};
+
+/*
+ * @description     : 从设备树中获取滤波参数，没有设置的话使用默认值
+ * @param - client 	: 要操作的i2c
+ * @param - multidev: 自定义的multitouch设备
+ * @return          : 无
+ */
+static void ft5x06_filter_init(struct i2c_client *client, struct ft5x06_dev *dev)
+{
+	struct device_node *np = client->dev.of_node;
+
+	dev->filter_weight = FT5X06_FILTER_WEIGHT;
+	dev->filter_deadband = FT5X06_FILTER_DEADBAND;
+	dev->filter_fast = FT5X06_FILTER_FAST;
+
+	of_property_read_u32(np, "edt,filter-weight", &dev->filter_weight);
+	of_property_read_u32(np, "edt,filter-deadband", &dev->filter_deadband);
+	of_property_read_u32(np, "edt,filter-fast", &dev->filter_fast);
+
+	/* 和sysfs使用同样的上限 */
+	dev->filter_weight = min_t(unsigned int, dev->filter_weight, FT5X06_FILTER_ONE);
+	dev->filter_deadband = min_t(unsigned int, dev->filter_deadband, FT5X06_FILTER_DEADBAND_MAX);
+	dev->filter_fast = min_t(unsigned int, dev->filter_fast, FT5X06_FILTER_FAST_MAX);
+
+	memset(dev->filter, 0, sizeof(dev->filter));
+}
+
 /*
  * @description     : FT5x06中断初始化
  * @param - client 	: 要操作的i2c
@@ -271,6 +420,8 @@ static int ft5x06_ts_probe(struct i2c_client *client, const struct i2c_device_id
 	ft5x06.irq_pin = of_get_named_gpio(client->dev.of_node, "interrupt-gpios", 0);
 	ft5x06.reset_pin = of_get_named_gpio(client->dev.of_node, "reset-gpios", 0);
 
+	ft5x06_filter_init(client, &ft5x06);
+
 	/* 2，复位FT5x06 */
 	ret = ft5x06_ts_reset(client, &ft5x06);
 	if(ret < 0) {
@@ -317,8 +468,16 @@ static int ft5x06_ts_probe(struct i2c_client *client, const struct i2c_device_id
 	if (ret)
 		goto fail;
 
+	/* 6，创建滤波参数的sysfs文件 */
+	ret = sysfs_create_group(&client->dev.kobj, &ft5x06_attr_group);
+	if (ret)
+		goto fail_sysfs;
+
 	return 0;
 
+fail_sysfs:
+	input_unregister_device(ft5x06.input);
+
 fail:
 	return ret;
 }
@@ -330,6 +489,8 @@ fail:
  */
 static int ft5x06_ts_remove(struct i2c_client *client)
 {	
+	sysfs_remove_group(&client->dev.kobj, &ft5x06_attr_group);
+
 	/* 释放input_dev */
 	input_unregister_device(ft5x06.input);
 	return 0;
@@ -15,6 +15,16 @@
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
 #include <linux/hdreg.h>
+#include <linux/highmem.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/slab.h>
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
 
 #include <asm/mach/map.h>
 #include <asm/uaccess.h>
@@ -22,7 +32,85 @@
 
 #define RAMDISK_NAME 	"ramdisk"    /* 名字 */
 #define RADMISK_MINOR	3					/* 表示有三个磁盘分区！不是次设备号为3！ */
-#define RAMDISK_SIZE	(2 * 1024 * 1024) 	/* 容量大小为2MB */
+#define RAMDISK_SIZE	(2 * 1024 * 1024) 	/* 默认容量大小为2MB */
+#define PAGE_SECTORS_SHIFT	(PAGE_SHIFT - 9)		/* 一页对应的扇区数的位数 */
+#define PAGE_SECTORS		(1 << PAGE_SECTORS_SHIFT)	/* 一页对应的扇区数 */
+#define FREE_BATCH			16			/* 卸载时一次从radix树中取出的页数 */
+
+/* 容量大小，单位KB，只有写过的页才分配内存，所以可以比内存大 */
+static unsigned long ramdisk_size = RAMDISK_SIZE / 1024;
+module_param(ramdisk_size, ulong, 0444);
+MODULE_PARM_DESC(ramdisk_size, "Size of the ramdisk in kbytes");
+
+/* 队列参数，逻辑块和物理块大小可以是512或者4096 */
+static unsigned int logical_block_size = 512;
+module_param(logical_block_size, uint, 0444);
+MODULE_PARM_DESC(logical_block_size, "Logical block size in bytes (512 or 4096)");
+
+static unsigned int physical_block_size = 4096;
+module_param(physical_block_size, uint, 0444);
+MODULE_PARM_DESC(physical_block_size, "Physical block size in bytes (512 or 4096)");
+
+static unsigned int max_sectors = 1024;
+module_param(max_sectors, uint, 0444);
+MODULE_PARM_DESC(max_sectors, "Maximum sectors per request");
+
+static unsigned int max_segments = 128;
+module_param(max_segments, uint, 0444);
+MODULE_PARM_DESC(max_segments, "Maximum segments per request");
+
+/* 完成方式，用来模拟慢速设备：
+ * 0：在请求处理函数中同步完成
+ * 1：在hrtimer回调中批量完成
+ * 2：hrtimer到期后在工作队列中批量完成
+ */
+#define COMPLETE_SYNC		0
+#define COMPLETE_HRTIMER	1
+#define COMPLETE_WORKQUEUE	2
+
+static int completion_mode = COMPLETE_SYNC;
+module_param(completion_mode, int, 0444);
+MODULE_PARM_DESC(completion_mode, "Completion mode: 0 = sync, 1 = hrtimer, 2 = workqueue");
+
+static unsigned int latency_us = 0;
+module_param(latency_us, uint, 0644);
+MODULE_PARM_DESC(latency_us, "Emulated per-I/O latency in microseconds (async modes)");
+
+static unsigned int bandwidth_kbs = 0;
+module_param(bandwidth_kbs, uint, 0644);
+MODULE_PARM_DESC(bandwidth_kbs, "Emulated bandwidth in KB/s, 0 = unlimited (async modes)");
+
+static unsigned int queue_depth = 32;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Maximum in-flight requests (async modes)");
+
+#define LAT_BUCKETS		20		/* 延迟直方图的桶数，第i个桶为[2^(i-1), 2^i)us，最后一个桶包含更大的延迟 */
+
+/* I/O类型，用于延迟统计 */
+enum ramdisk_op {
+	RAMDISK_OP_READ,
+	RAMDISK_OP_WRITE,
+	RAMDISK_OP_DISCARD,
+	RAMDISK_OP_NUM,
+};
+
+static const char * const ramdisk_op_name[RAMDISK_OP_NUM] = { "read", "write", "discard" };
+
+/* 每种I/O类型的延迟直方图 */
+struct ramdisk_lat {
+	atomic64_t buckets[LAT_BUCKETS];	/* 落在每个区间的I/O数量 */
+	atomic64_t total_ns;				/* 总延迟 */
+	atomic64_t max_ns;					/* 最大延迟 */
+};
+
+/* 异步模式下等待完成的请求 */
+struct ramdisk_cmd {
+	struct request *req;	/* 请求 */
+	int err;				/* 传输结果 */
+	enum ramdisk_op op;		/* I/O类型 */
+	ktime_t start;			/* 开始处理的时间 */
+	ktime_t due;			/* 应该完成的时间 */
+};
 
 /* ramdisk设备结构体 */
 struct ramdisk_dev{
@@ -30,7 +118,20 @@ struct ramdisk_dev{
 	struct gendisk *gendisk;  /* 请求队列 */
 	struct request_queue *queue;   /* gendisk */
 	spinlock_t lock;  /* 自旋锁 */
-	unsigned char *ramdiskbuf;   /* ramdisk内存空间,用于模拟块设备 */     
+	spinlock_t pages_lock;   /* 只在修改pages时使用，查找使用RCU */
+	struct radix_tree_root pages;   /* ramdisk内存空间，以页号为索引保存写过的页，参考brd.c(drivers/block/brd.c) */
+	unsigned long size;   /* ramdisk容量，单位为字节 */
+	struct ramdisk_lat lat[RAMDISK_OP_NUM];   /* 每种I/O类型的延迟直方图 */
+	struct dentry *debugfs;   /* debugfs目录 */
+
+	/* 异步完成模式使用，cmds是一个环形队列，完成时间单调递增，按顺序完成即可 */
+	struct ramdisk_cmd *cmds;   /* 等待完成的请求 */
+	unsigned int head, tail, count;   /* 环形队列的头、尾和数量，由队列锁保护 */
+	unsigned int reserved;   /* 已经取出、正在拷贝数据还没有加入环形队列的请求数量，由队列锁保护 */
+	ktime_t busy_until;   /* 模拟带宽时，设备传输空闲的时间 */
+	ktime_t last_due;   /* 最后加入队列的请求的完成时间 */
+	struct hrtimer timer;   /* 完成定时器 */
+	struct work_struct work;   /* 工作队列模式下的完成工作 */
 };
 
 struct ramdisk_dev ramdisk;
@@ -67,9 +168,9 @@ static void ramdisk_release (struct gendisk *gendisk, fmode_t mode)
 static int ramdisk_getgeo (struct block_device *dev, struct hd_geometry *geo)
 {
 	/* 这是相对于机械硬盘的概念 */
-	geo->heads = 2;			/* 磁头 */
-	geo->cylinders = 32;	/* 柱面 */
-	geo->sectors = RAMDISK_SIZE / (2 * 32 *512); /* 一个磁道上的扇区数量 */
+	geo->heads = 4;			/* 磁头 */
+	geo->sectors = 16;		/* 一个磁道上的扇区数量 */
+	geo->cylinders = min_t(unsigned long, ramdisk.size / (4 * 16 * 512), 0xffff);	/* 柱面 */
 	return 0;
 }
 
@@ -85,29 +186,522 @@ static struct block_device_operations ramdisk_fops=
 };
 
 /*
- * @description	: 处理传输过程
- * @param-req 	: 请求
+ * @description	: 查找扇区所在的页，查找不需要加锁。
+ *				  返回的页只有在调用者处于RCU读临界区内时才能安全访问
+ * @param-sector: 扇区地址
+ * @return 		: 找到的页，没有分配过的话返回NULL
+ */
+static struct page *ramdisk_lookup_page(sector_t sector)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;	/* 页号 */
+	struct page *page;
+
+	rcu_read_lock();
+	page = radix_tree_lookup(&ramdisk.pages, idx);
+	rcu_read_unlock();
+
+	return page;
+}
+
+/*
+ * @description	: 查找扇区所在的页，没有的话就分配一个清零的页并插入radix树。
+ *				  和25_ramdisk_norequest不同，这里在请求处理函数中调用，不能睡眠，
+ *				  所以使用GFP_ATOMIC分配，radix树的节点也由GFP_ATOMIC分配，不需要预加载
+ * @param-sector: 扇区地址
+ * @return 		: 页，内存不足时返回NULL
+ */
+static struct page *ramdisk_insert_page(sector_t sector)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	struct page *page;
+
+	page = ramdisk_lookup_page(sector);
+	if (page)
+		return page;
+
+	/* 数据都通过kmap_atomic访问，所以页可以分配在高端内存 */
+	page = alloc_page(GFP_ATOMIC | __GFP_NOWARN | __GFP_ZERO | __GFP_HIGHMEM);
+	if (!page)
+		return NULL;
+
+	/* 插入时才加锁，两个上下文同时分配同一页的话，后插入的使用已有的页 */
+	spin_lock(&ramdisk.pages_lock);
+	page->index = idx;
+	if (radix_tree_insert(&ramdisk.pages, idx, page)) {
+		__free_page(page);
+		page = radix_tree_lookup(&ramdisk.pages, idx);
+	}
+	spin_unlock(&ramdisk.pages_lock);
+
+	return page;
+}
+
+/*
+ * @description	: 释放所有已分配的页
+ * @param 		: 无
  * @return 		: 无
  */
-static void ramdisk_transfer(struct request *req)
+static void ramdisk_free_pages(void)
+{
+	unsigned long pos = 0;
+	struct page *pages[FREE_BATCH];
+	int nr_pages, i;
+
+	do {
+		nr_pages = radix_tree_gang_lookup(&ramdisk.pages, (void **)pages, pos, FREE_BATCH);
+		for (i = 0; i < nr_pages; i++) {
+			pos = pages[i]->index;
+			radix_tree_delete(&ramdisk.pages, pos);
+			__free_page(pages[i]);
+		}
+		pos++;
+	} while (nr_pages == FREE_BATCH);
+}
+
+/*
+ * @description	: RCU回调，所有读者都退出临界区后再真正释放页
+ * @param-head 	: 页中的rcu_head
+ * @return 		: 无
+ */
+static void ramdisk_free_page_rcu(struct rcu_head *head)
+{
+	__free_page(container_of(head, struct page, rcu_head));
+}
+
+/*
+ * @description	: 释放扇区所在的页，页被删除后再读就返回0。
+ *				  其他请求可能正在RCU临界区内访问这个页，所以延迟释放
+ * @param-sector: 扇区地址
+ * @return 		: 无
+ */
+static void ramdisk_free_page(sector_t sector)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	struct page *page;
+
+	spin_lock(&ramdisk.pages_lock);
+	page = radix_tree_delete(&ramdisk.pages, idx);
+	spin_unlock(&ramdisk.pages_lock);
+
+	if (page)
+		call_rcu(&page->rcu_head, ramdisk_free_page_rcu);
+}
+
+/*
+ * @description	: 把扇区所在页中的一段清零，没有分配过的页本来就是0
+ * @param-sector: 扇区地址
+ * @param-n 	: 长度，不能跨页
+ * @return 		: 无
+ */
+static void ramdisk_zero_range(sector_t sector, size_t n)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << 9;
+	struct page *page;
+	void *mem;
+
+	rcu_read_lock();
+	page = radix_tree_lookup(&ramdisk.pages, sector >> PAGE_SECTORS_SHIFT);
+	if (page) {
+		mem = kmap_atomic(page);
+		memset(mem + offset, 0, n);
+		kunmap_atomic(mem);
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * @description	: 处理discard请求，整页直接释放，归还给系统，
+ *				  不满一页的部分清零，保证discard之后读回来的数据为0
+ * @param-sector: 起始扇区
+ * @param-n 	: 长度
+ * @return 		: 无
+ */
+static void discard_from_ramdisk(sector_t sector, size_t n)
+{
+	unsigned int offset;
+	size_t len;
+
+	while (n > 0) {
+		offset = (sector & (PAGE_SECTORS - 1)) << 9;
+		len = min_t(size_t, n, PAGE_SIZE - offset);
+
+		if (len == PAGE_SIZE)
+			ramdisk_free_page(sector);
+		else
+			ramdisk_zero_range(sector, len);
+
+		sector += len >> 9;
+		n -= len;
+	}
+}
+
+/*
+ * @description	: 写数据之前先分配好要用到的页，一个段最多跨越两个页
+ * @param-sector: 扇区地址
+ * @param-n 	: 数据长度
+ * @return 		: 0 成功;其他 失败
+ */
+static int copy_to_ramdisk_setup(sector_t sector, size_t n)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << 9;	/* 页内偏移 */
+	size_t copy = min_t(size_t, n, PAGE_SIZE - offset);
+
+	if (!ramdisk_insert_page(sector))
+		return -ENOMEM;
+	if (copy < n) {		/* 数据跨越两个页 */
+		sector += copy >> 9;
+		if (!ramdisk_insert_page(sector))
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * @description	: 在RCU读临界区内拷贝一页之内的数据，拷贝期间页不会被释放
+ * @param-buf 	: 读的时候为目的地址，写的时候为源地址
+ * @param-sector: 扇区地址
+ * @param-n 	: 数据长度，不能跨页
+ * @param-rw 	: 读或者写
+ * @return 		: 0 成功;-EAGAIN 写的时候页已经被discard释放
+ */
+static int ramdisk_copy_chunk(void *buf, sector_t sector, size_t n, int rw)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << 9;	/* 页内偏移 */
+	struct page *page;
+	void *mem;
+	int err = 0;
+
+	rcu_read_lock();
+	page = radix_tree_lookup(&ramdisk.pages, sector >> PAGE_SECTORS_SHIFT);
+	if (page) {
+		mem = kmap_atomic(page);
+		if (rw == READ)
+			memcpy(buf, mem + offset, n);
+		else
+			memcpy(mem + offset, buf, n);
+		kunmap_atomic(mem);
+	} else if (rw == READ) {
+		memset(buf, 0, n);		/* 没有写过的页读出来为0 */
+	} else {
+		err = -EAGAIN;
+	}
+	rcu_read_unlock();
+
+	return err;
+}
+
+/*
+ * @description	: 在ramdisk和bio的一个段之间拷贝数据，数据可能跨越两个页
+ * @param-buf 	: 段的内核地址
+ * @param-sector: 扇区地址
+ * @param-n 	: 数据长度
+ * @param-rw 	: 读或者写
+ * @return 		: 0 成功;-EAGAIN 写的时候页被同时进行的discard释放了，需要重新分配
+ */
+static int ramdisk_copy(void *buf, sector_t sector, size_t n, int rw)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << 9;	/* 页内偏移 */
+	size_t copy = min_t(size_t, n, PAGE_SIZE - offset);
+	int err;
+
+	err = ramdisk_copy_chunk(buf, sector, copy, rw);
+	if (err || copy == n)
+		return err;
+
+	/* 剩下的数据在下一页 */
+	return ramdisk_copy_chunk(buf + copy, sector + (copy >> 9), n - copy, rw);
+}
+
+/*
+ * @description	: 处理一个段，读没有写过的页直接返回0，写的时候才分配页
+ * @param-bvec 	: 段
+ * @param-sector: 扇区地址
+ * @param-rw 	: 读或者写
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_do_bvec(struct bio_vec *bvec, sector_t sector, int rw)
+{
+	void *buffer;
+	int err;
+
+	do {
+		if (rw != READ) {
+			err = copy_to_ramdisk_setup(sector, bvec->bv_len);
+			if (err)
+				return err;
+		}
+		buffer = kmap_atomic(bvec->bv_page);	/* 页可能位于高端内存，需要临时映射 */
+		err = ramdisk_copy(buffer + bvec->bv_offset, sector, bvec->bv_len, rw);
+		kunmap_atomic(buffer);
+	} while (err == -EAGAIN);	/* 和discard并发时页可能刚被释放，重新分配后再写 */
+
+	return err;
+}
+
+/*
+ * @description	: 处理传输过程，一次性处理整个请求中所有bio的所有段
+ * @param-req 	: 请求
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_transfer(struct request *req)
 {	
-	unsigned long start = blk_rq_pos(req) << 9;  	/* blk_rq_pos获取到的是扇区地址偏移，左移9位(需要将扇区地址转换为原始地址-512字节=2^9)*/
-	unsigned long len  = blk_rq_cur_bytes(req);		/* 获取请求要操作的数据长度   */
-
-	/* bio中的数据缓冲区
-	 * 读：从磁盘读取到的数据存放到buffer中
-	 * 写：buffer保存这要写入磁盘的数据
-	 */
-	void *buffer = bio_data(req->bio);	/* bio_data函数获取请求中bio缓存区(ram)保存的数据 */
-	
-	/* 调用 rq_data_dir 函数判断当前是读还是写 */
-	if(rq_data_dir(req) == READ) 		/* 读数据 */	
-		memcpy(buffer, ramdisk.ramdiskbuf + start, len);   /* 内存模拟采用memcpy */
-	else if(rq_data_dir(req) == WRITE) 	/* 写数据 */
-		memcpy(ramdisk.ramdiskbuf + start, buffer, len);
+	sector_t sector = blk_rq_pos(req);  	/* 扇区地址 */
+	struct req_iterator iter;	/* 遍历请求中所有bio的迭代器 */
+	struct bio_vec bvec;		/* 一个段的页、页内偏移和长度 */
+	int err;
+
+	if ((sector << 9) + blk_rq_bytes(req) > ramdisk.size)	/* 越界检查 */
+		return -EIO;
+
+	/* discard请求不带数据，整页直接释放 */
+	if (req->cmd_flags & REQ_DISCARD) {
+		discard_from_ramdisk(sector, blk_rq_bytes(req));
+		return 0;
+	}
 
+	rq_for_each_segment(bvec, req, iter) {		/* 遍历请求中的所有段 */
+		err = ramdisk_do_bvec(&bvec, sector, rq_data_dir(req));
+		if (err)
+			return err;
+		sector += bvec.bv_len >> 9;
+	}
+
+	return 0;
+}
+
+/*
+ * @description	: 记录一次I/O的延迟
+ * @param-op 	: I/O类型
+ * @param-start : I/O开始的时间
+ * @return 		: 无
+ */
+static void ramdisk_lat_account(enum ramdisk_op op, ktime_t start)
+{
+	struct ramdisk_lat *lat = &ramdisk.lat[op];
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	u64 max;
+	int bucket;
+
+	bucket = min_t(int, fls64(div_u64(ns, 1000)), LAT_BUCKETS - 1);   /* 按微秒取log2 */
+	atomic64_inc(&lat->buckets[bucket]);
+	atomic64_add(ns, &lat->total_ns);
+
+	max = atomic64_read(&lat->max_ns);
+	while (ns > max && atomic64_cmpxchg(&lat->max_ns, max, ns) != max)
+		max = atomic64_read(&lat->max_ns);
+}
+
+/*
+ * @description	: debugfs中的latency文件，输出每种I/O类型的延迟直方图
+ * @param-m 	: seq_file
+ * @param-v 	: 未使用
+ * @return 		: 0
+ */
+static int ramdisk_lat_show(struct seq_file *m, void *v)
+{
+	struct ramdisk_lat *lat;
+	u64 count, total;
+	int op, i;
+
+	for (op = 0; op < RAMDISK_OP_NUM; op++) {
+		lat = &ramdisk.lat[op];
+		count = 0;
+		for (i = 0; i < LAT_BUCKETS; i++)
+			count += atomic64_read(&lat->buckets[i]);
+		total = atomic64_read(&lat->total_ns);
+
+		seq_printf(m, "%s: count %llu avg_ns %llu max_ns %llu\n", ramdisk_op_name[op],
+			count, count ? div64_u64(total, count) : 0,
+			(u64)atomic64_read(&lat->max_ns));
+		for (i = 0; i < LAT_BUCKETS; i++) {
+			if (!atomic64_read(&lat->buckets[i]))
+				continue;
+			seq_printf(m, "  %8lu - %8lu us: %llu\n", i ? 1UL << (i - 1) : 0,
+				i == LAT_BUCKETS - 1 ? ULONG_MAX : 1UL << i,
+				(u64)atomic64_read(&lat->buckets[i]));
+		}
+	}
+	return 0;
+}
+
+static int ramdisk_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ramdisk_lat_show, NULL);
+}
+
+/*
+ * @description	: 向latency文件写任意内容清空统计数据
+ */
+static ssize_t ramdisk_lat_write(struct file *file, const char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	int op, i;
+
+	for (op = 0; op < RAMDISK_OP_NUM; op++) {
+		for (i = 0; i < LAT_BUCKETS; i++)
+			atomic64_set(&ramdisk.lat[op].buckets[i], 0);
+		atomic64_set(&ramdisk.lat[op].total_ns, 0);
+		atomic64_set(&ramdisk.lat[op].max_ns, 0);
+	}
+	return count;
+}
+
+static const struct file_operations ramdisk_lat_fops = {
+	.owner = THIS_MODULE,
+	.open = ramdisk_lat_open,
+	.read = seq_read,
+	.write = ramdisk_lat_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * @description	: 检查队列相关的模块参数，容量要按逻辑块大小对齐，所以在计算容量之前调用
+ * @param 		: 无
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_check_queue_params(void)
+{
+	if ((logical_block_size != 512 && logical_block_size != 4096) ||
+		(physical_block_size != 512 && physical_block_size != 4096) ||
+		physical_block_size < logical_block_size) {
+		printk("ramdisk: invalid block size %u/%u\r\n", logical_block_size, physical_block_size);
+		return -EINVAL;
+	}
+	if (max_sectors < (PAGE_SIZE >> 9) || max_segments == 0) {
+		printk("ramdisk: invalid max_sectors %u or max_segments %u\r\n", max_sectors, max_segments);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * @description	: 设置请求队列的限制，告诉文件系统和页缓存按块大小对齐
+ *				  并且尽量发出大的I/O，避免读改写和合并的开销，参数已经由ramdisk_check_queue_params检查过
+ * @param-q 	: 请求队列
+ * @return 		: 无
+ */
+static void ramdisk_set_queue_limits(struct request_queue *q)
+{
+	blk_queue_logical_block_size(q, logical_block_size);
+	blk_queue_physical_block_size(q, physical_block_size);
+	blk_queue_io_min(q, physical_block_size);		/* 最小I/O为一个物理块 */
+	blk_queue_io_opt(q, max_sectors << 9);			/* 最优I/O为一个最大请求 */
+	blk_queue_max_hw_sectors(q, max_sectors);
+	blk_queue_max_segments(q, max_segments);
+
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, q);		/* 非旋转设备，不需要寻道优化 */
+	queue_flag_clear_unlocked(QUEUE_FLAG_ADD_RANDOM, q);	/* 不为熵池贡献随机数 */
+}
+
+/*
+ * @description	: 完成所有已经到期的请求，调用时需要持有队列锁。
+ *				  完成一批之后如果队列因为满了而停止，就重新启动
+ * @param-now 	: 当前时间
+ * @return 		: 无
+ */
+static void ramdisk_complete_due(ktime_t now)
+{
+	struct request_queue *q = ramdisk.queue;
+	struct ramdisk_cmd *cmd;
+
+	while (ramdisk.count) {
+		cmd = &ramdisk.cmds[ramdisk.head];
+		if (ktime_after(cmd->due, now))
+			break;
+		__blk_end_request_all(cmd->req, cmd->err);
+		ramdisk_lat_account(cmd->op, cmd->start);
+		ramdisk.head = (ramdisk.head + 1) % queue_depth;
+		ramdisk.count--;
+	}
+
+	/* 不能在这里直接调用请求处理函数，交给kblockd */
+	if (blk_queue_stopped(q) && ramdisk.count + ramdisk.reserved < queue_depth) {
+		queue_flag_clear(QUEUE_FLAG_STOPPED, q);
+		blk_run_queue_async(q);
+	}
+}
+
+/*
+ * @description	: 工作队列模式的完成函数，在进程上下文中批量完成请求
+ * @param-work 	: 工作
+ * @return 		: 无
+ */
+static void ramdisk_complete_work(struct work_struct *work)
+{
+	struct request_queue *q = ramdisk.queue;
+
+	spin_lock_irq(q->queue_lock);
+	ramdisk_complete_due(ktime_get());
+	if (ramdisk.count)		/* 还有没到期的请求，重新定时 */
+		hrtimer_start(&ramdisk.timer, ramdisk.cmds[ramdisk.head].due, HRTIMER_MODE_ABS);
+	spin_unlock_irq(q->queue_lock);
+}
+
+/*
+ * @description	: 完成定时器回调函数
+ * @param-timer : 定时器
+ * @return 		: 是否重新启动定时器
+ */
+static enum hrtimer_restart ramdisk_timer_fn(struct hrtimer *timer)
+{
+	struct request_queue *q = ramdisk.queue;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	unsigned long flags;
+
+	if (completion_mode == COMPLETE_WORKQUEUE) {
+		schedule_work(&ramdisk.work);
+		return HRTIMER_NORESTART;
+	}
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	ramdisk_complete_due(ktime_get());
+	if (ramdisk.count) {	/* 下一个请求的完成时间 */
+		hrtimer_set_expires(timer, ramdisk.cmds[ramdisk.head].due);
+		ret = HRTIMER_RESTART;
+	}
+	spin_unlock_irqrestore(q->queue_lock, flags);
+
+	return ret;
 }
 
+/*
+ * @description	: 把请求加入等待完成的队列，根据延迟和带宽计算完成时间，
+ *				  调用时需要持有队列锁，并且已经在ramdisk.reserved中预留了位置
+ * @param-req 	: 请求
+ * @param-err 	: 传输结果
+ * @param-op 	: I/O类型
+ * @param-start : 开始处理的时间
+ * @return 		: 无
+ */
+static void ramdisk_queue_cmd(struct request *req, int err, enum ramdisk_op op, ktime_t start)
+{
+	struct ramdisk_cmd *cmd = &ramdisk.cmds[ramdisk.tail];
+	ktime_t now = ktime_get();
+	u64 xfer_ns = 0;
+
+	/* 带宽限制：传输通道同一时间只能传一个请求 */
+	if (bandwidth_kbs && op != RAMDISK_OP_DISCARD)
+		xfer_ns = div64_u64((u64)blk_rq_bytes(req) * NSEC_PER_SEC, (u64)bandwidth_kbs * 1024);
+	if (ktime_before(ramdisk.busy_until, now))
+		ramdisk.busy_until = now;
+	ramdisk.busy_until = ktime_add_ns(ramdisk.busy_until, xfer_ns);
+
+	cmd->req = req;
+	cmd->err = err;
+	cmd->op = op;
+	cmd->start = start;
+	cmd->due = ktime_add_us(ramdisk.busy_until, latency_us);
+	/* latency_us可以在运行时修改，改小后新请求不能早于前面的请求完成，否则会被队头的请求挡住 */
+	if (ramdisk.count && ktime_before(cmd->due, ramdisk.last_due))
+		cmd->due = ramdisk.last_due;
+	ramdisk.last_due = cmd->due;
+
+	ramdisk.reserved--;
+	ramdisk.tail = (ramdisk.tail + 1) % queue_depth;
+	if (ramdisk.count++ == 0)	/* 队列原来为空，定时器没有运行 */
+		hrtimer_start(&ramdisk.timer, cmd->due, HRTIMER_MODE_ABS);
+}
 
 /*
  * @description	: 请求处理函数，完成从块设备中读取数据，或者向块设备中写入数据
@@ -118,15 +712,50 @@ void ramdisk_request_fn(struct request_queue *q)
 {
 	int err=0;
 	struct request *req;
-	req=blk_fetch_request(q);  /* 包含I/O调度算法 */
-	/* struct request *blk_fetch_request(struct request_queue *q){}-一次性完成请求的获取和开启,获取到请求队列中第一个请求 */
-	while(req != NULL) {     /* 依次处理完请求队列中的每个请求 */
+	enum ramdisk_op op;
+	ktime_t start;
+
+	/* 进入此函数时已经持有队列锁 */
+	while (1) {
+		/* 异步模式下正在处理的请求达到队列深度，停止队列，等完成后再启动。
+		 * 拷贝数据时会释放队列锁，其他CPU或者kblockd可能同时进入这个函数，
+		 * 所以正在拷贝的请求也要算上 */
+		if (completion_mode != COMPLETE_SYNC &&
+			ramdisk.count + ramdisk.reserved >= queue_depth) {
+			blk_stop_queue(q);
+			break;
+		}
+
+		req = blk_fetch_request(q);     /* 依次处理完请求队列中的每个请求，blk_fetch_request包含I/O调度算法 */
+		if (req == NULL)
+			break;
+		if (completion_mode != COMPLETE_SYNC)
+			ramdisk.reserved++;		/* 释放锁之前预留环形队列中的位置 */
+
+		/* 请求已经从队列中取出，拷贝数据期间不需要持有队列锁 */
+		spin_unlock_irq(q->queue_lock);
+		start = ktime_get();
+		if (req->cmd_flags & REQ_DISCARD)
+			op = RAMDISK_OP_DISCARD;
+		else
+			op = rq_data_dir(req) == READ ? RAMDISK_OP_READ : RAMDISK_OP_WRITE;
+
 		/* 针对请求做具体的传输处理 */
-		ramdisk_transfer(req);   /* 请求不为空的话就调用 ramdisk_transfer 函数进行对请求做进一步的处理 */
+		if (req->cmd_type != REQ_TYPE_FS)
+			err = -EIO;
+		else
+			err = ramdisk_transfer(req);
 
-		/* 检查是否为最后一个请求，如果不是的话就继续获取下一个，直至整个请求队列处理完成 */
-		if (!__blk_end_request_cur(req, err))  /* 当前请求中的chunk，且需要持有队列锁，参考*/
-			req = blk_fetch_request(q);    
+		spin_lock_irq(q->queue_lock);
+
+		if (completion_mode != COMPLETE_SYNC) {
+			ramdisk_queue_cmd(req, err, op, start);	/* 由定时器或者工作队列完成 */
+			continue;
+		}
+
+		/* 一次性完成整个请求，需要持有队列锁 */
+		__blk_end_request_all(req, err);
+		ramdisk_lat_account(op, start);
 	}
 }
 
@@ -140,17 +769,23 @@ static int __init ramdisk_init(void)
 	int ret=0;
 	printk("ramdisk init\r\n");
 
-	/* 1、申请用于ramdisk内存 */
-	ramdisk.ramdiskbuf=kzalloc(RAMDISK_SIZE,GFP_KERNEL);    /* 正常分配内存 */
-	if(ramdisk.ramdiskbuf==NULL){
-		ret = -EINVAL;
-		goto ram_fail;
+	/* 1、初始化ramdisk内存，数据保存在radix树的页中 */
+	ret = ramdisk_check_queue_params();
+	if (ret)
+		return ret;
+	ramdisk.size = round_down(ramdisk_size * 1024, logical_block_size);   /* 容量为逻辑块大小的整数倍 */
+	if (ramdisk.size == 0) {
+		printk("ramdisk: size %luKB is smaller than one block\r\n", ramdisk_size);
+		return -EINVAL;
 	}
+	spin_lock_init(&ramdisk.pages_lock);
+	INIT_RADIX_TREE(&ramdisk.pages, GFP_ATOMIC);   /* 页在第一次写的时候才分配 */
 
 	/* 2、注册块设备 */
 	ramdisk.major=register_blkdev(0,RAMDISK_NAME);
 	/* int register_blkdev(unsigned int major, const char *name),由系统自动分配主设备号，那么返回值就是系统分配的主设备号(1~255)，如果返回负值那就表示注册失败 */
 	if(ramdisk.major<0){
+		ret = ramdisk.major;
 		goto register_blkdev_fail;
 	}
 	printk("ramdisk major = %d\r\n", ramdisk.major);
@@ -166,6 +801,26 @@ static int __init ramdisk_init(void)
 	/* 4、初始化自旋锁 */
 	spin_lock_init(&ramdisk.lock);
 
+	/* 异步完成模式的环形队列和定时器 */
+	if (completion_mode != COMPLETE_SYNC) {
+		if (completion_mode != COMPLETE_HRTIMER && completion_mode != COMPLETE_WORKQUEUE) {
+			ret = -EINVAL;
+			goto blk_init_fail;
+		}
+		if (queue_depth == 0)
+			queue_depth = 1;
+		ramdisk.cmds = kcalloc(queue_depth, sizeof(*ramdisk.cmds), GFP_KERNEL);
+		if (!ramdisk.cmds) {
+			ret = -ENOMEM;
+			goto blk_init_fail;
+		}
+		hrtimer_init(&ramdisk.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+		ramdisk.timer.function = ramdisk_timer_fn;
+		INIT_WORK(&ramdisk.work, ramdisk_complete_work);
+		printk("ramdisk async completion, latency %uus, bandwidth %uKB/s, depth %u\r\n",
+			latency_us, bandwidth_kbs, queue_depth);
+	}
+
 	/* 5、初始化请求队列 */
 	ramdisk.queue=blk_init_queue(ramdisk_request_fn,&ramdisk.lock);
 	/* request_queue *blk_init_queue(request_fn_proc *rfn, spinlock_t *lock) 请求处理函数指针 */
@@ -173,6 +828,17 @@ static int __init ramdisk_init(void)
 		ret=-EINVAL;
 		goto blk_init_fail;
 	}
+
+	ramdisk_set_queue_limits(ramdisk.queue);
+
+	/* 支持discard，discard之后读到的数据为0 */
+	ramdisk.queue->limits.discard_granularity = logical_block_size;
+	blk_queue_max_discard_sectors(ramdisk.queue, UINT_MAX);
+	ramdisk.queue->limits.discard_zeroes_data = 1;
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, ramdisk.queue);
+
+	/* 开启I/O统计，结果在/sys/block/ramdisk/stat和/proc/diskstats中 */
+	queue_flag_set_unlocked(QUEUE_FLAG_IO_STAT, ramdisk.queue);
 	
 	/* 6、初始化gendisk 参考z2ram.c(drivers/block/z2ram.c)*/
 	ramdisk.gendisk->major=ramdisk.major;  /* 主设备号 */
@@ -184,23 +850,27 @@ static int __init ramdisk_init(void)
 	//ramdisk.gendisk->disk_name=RAMDISK_NAME;      /* 名字 */
 	sprintf(ramdisk.gendisk->disk_name, RAMDISK_NAME);   /* 名字，给字符数组类型赋值 */
 
-	set_capacity(ramdisk.gendisk,RAMDISK_SIZE/512);  /* 设备容量(单位为扇区) */
+	set_capacity(ramdisk.gendisk,ramdisk.size/512);  /* 设备容量(单位为扇区) */
 	/* void set_capacity(struct gendisk *disk, sector_t size)-设置 gendisk 容量 ,扇区数量(1个扇区512字节)*/
 
 	/* 7、将gendisk添加内核 */
 	add_disk(ramdisk.gendisk);
 	/* void add_disk(struct gendisk *disk)-将 gendisk 添加到内核 */
 
+	/* 8、在debugfs中创建延迟直方图，/sys/kernel/debug/ramdisk/latency */
+	ramdisk.debugfs = debugfs_create_dir(RAMDISK_NAME, NULL);
+	if (!IS_ERR_OR_NULL(ramdisk.debugfs))
+		debugfs_create_file("latency", 0644, ramdisk.debugfs, NULL, &ramdisk_lat_fops);
+
 	return 0;
 
 blk_init_fail:
+	kfree(ramdisk.cmds);
 	put_disk(ramdisk.gendisk);   /* put_disk 是减少 gendisk 的引用计数 */
 	//del_gendisk(ramdisk.gendisk);
 gendisk_alloc_fail:
 	unregister_blkdev(ramdisk.major,RAMDISK_NAME);
 register_blkdev_fail:
-	kfree(ramdisk.ramdiskbuf);  /* 释放内存 */
-ram_fail:
 	return ret;
 }
 
@@ -213,19 +883,29 @@ static void __exit ramdisk_exit(void)
 {
 	printk("ramdisk exit!\r\n");
 
+	debugfs_remove_recursive(ramdisk.debugfs);
+
 	/* 删除gendisk */
 	del_gendisk(ramdisk.gendisk);
 	put_disk(ramdisk.gendisk);   /* 参考 */
 
 
-	/* 删除请求队列 */
+	/* 删除请求队列，会等待所有请求完成 */
 	blk_cleanup_queue(ramdisk.queue);
 
+	/* 所有请求都已经完成，停止定时器和工作 */
+	if (completion_mode != COMPLETE_SYNC) {
+		hrtimer_cancel(&ramdisk.timer);
+		cancel_work_sync(&ramdisk.work);
+		kfree(ramdisk.cmds);
+	}
+
 	/* 注销块设备 */
 	unregister_blkdev(ramdisk.major,RAMDISK_NAME);
 
-	/* 释放内存 */
-	kfree(ramdisk.ramdiskbuf);
+	/* 释放内存，等待discard延迟释放的页 */
+	rcu_barrier();
+	ramdisk_free_pages();
 }
 
 /* 注册驱动加载和卸载 */
@@ -15,6 +15,20 @@
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
 #include <linux/hdreg.h>
+#include <linux/radix-tree.h>
+#include <linux/moduleparam.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/fs.h>
+#include <linux/vmalloc.h>
+#include <linux/crc32.h>
+#include <linux/lzo.h>
+#include <linux/lz4.h>
 
 #include <asm/mach/map.h>
 #include <asm/uaccess.h>
@@ -22,15 +36,151 @@
 
 #define RAMDISK_NAME 	"ramdisk"    /* 名字 */
 #define RADMISK_MINOR	3					/* 表示有三个磁盘分区！不是次设备号为3！ */
-#define RAMDISK_SIZE	(2 * 1024 * 1024) 	/* 容量大小为2MB */
+#define RAMDISK_SIZE	(2 * 1024 * 1024) 	/* 默认容量大小为2MB */
+
+#define PAGE_SECTORS_SHIFT	(PAGE_SHIFT - 9)		/* 一页对应的扇区数的位数 */
+#define PAGE_SECTORS		(1 << PAGE_SECTORS_SHIFT)	/* 一页对应的扇区数 */
+#define FREE_BATCH			16			/* 卸载时一次从radix树中取出的页数 */
+
+/* 容量大小，单位KB，只有写过的页才会真正分配内存 */
+static unsigned long ramdisk_size = RAMDISK_SIZE / 1024;
+module_param(ramdisk_size, ulong, 0444);
+MODULE_PARM_DESC(ramdisk_size, "Size of the ramdisk in kbytes");
+
+/* 队列参数，逻辑块和物理块大小可以是512或者4096 */
+static unsigned int logical_block_size = 512;
+module_param(logical_block_size, uint, 0444);
+MODULE_PARM_DESC(logical_block_size, "Logical block size in bytes (512 or 4096)");
+
+static unsigned int physical_block_size = 4096;
+module_param(physical_block_size, uint, 0444);
+MODULE_PARM_DESC(physical_block_size, "Physical block size in bytes (512 or 4096)");
+
+static unsigned int max_sectors = 1024;
+module_param(max_sectors, uint, 0444);
+MODULE_PARM_DESC(max_sectors, "Maximum sectors per request");
+
+static unsigned int max_segments = 128;
+module_param(max_segments, uint, 0444);
+MODULE_PARM_DESC(max_segments, "Maximum segments per request");
+
+/* 是否支持DAX直接访问，支持的话页不能分配在高端内存 */
+static bool dax = false;
+module_param(dax, bool, 0444);
+MODULE_PARM_DESC(dax, "Support direct access (DAX) to the ramdisk pages");
+
+/* 是否压缩保存数据，类似zram，开启后不支持dax */
+static bool compress = false;
+module_param(compress, bool, 0444);
+MODULE_PARM_DESC(compress, "Compress each page of the ramdisk in memory");
+
+/* 压缩算法，lzo或者lz4 */
+static char *comp_algorithm = "lzo";
+module_param(comp_algorithm, charp, 0444);
+MODULE_PARM_DESC(comp_algorithm, "Compression algorithm: lzo or lz4");
+
+/* 加载时从这个快照文件恢复数据，文件不存在的话就是一个空盘 */
+static char *restore = NULL;
+module_param(restore, charp, 0444);
+MODULE_PARM_DESC(restore, "Snapshot file to restore the ramdisk from at load time");
+
+#define SNAP_MAGIC		0x50414e53		/* 快照文件魔数"SNAP" */
+#define SNAP_VERSION	1				/* 快照文件格式版本 */
+#define SNAP_BATCH		64				/* 一次读写的页数，使用大块顺序I/O */
+
+/* 快照文件头，位于文件开头 */
+struct ramdisk_snap_hdr {
+	__le32 magic;			/* SNAP_MAGIC */
+	__le32 version;			/* SNAP_VERSION */
+	__le32 page_size;		/* 页大小 */
+	__le32 hdr_crc;			/* 文件头的crc32，计算时此字段为0 */
+	__le64 capacity;		/* 磁盘容量，单位为扇区 */
+	__le64 nr_pages;		/* 后面的页记录数量 */
+};
+
+/* 页记录，后面跟着一页数据，只保存分配过的页 */
+struct ramdisk_snap_rec {
+	__le64 index;			/* 页号 */
+	__le32 crc;				/* 页数据的crc32 */
+	__le32 reserved;
+};
+
+#define SNAP_REC_SIZE	(sizeof(struct ramdisk_snap_rec) + PAGE_SIZE)	/* 一条记录的大小 */
+
+#define LAT_BUCKETS		20		/* 延迟直方图的桶数，第i个桶为[2^(i-1), 2^i)us，最后一个桶包含更大的延迟 */
+
+/* I/O类型，用于延迟统计 */
+enum ramdisk_op {
+	RAMDISK_OP_READ,
+	RAMDISK_OP_WRITE,
+	RAMDISK_OP_DISCARD,
+	RAMDISK_OP_NUM,
+};
+
+static const char * const ramdisk_op_name[RAMDISK_OP_NUM] = { "read", "write", "discard" };
+
+/* 每种I/O类型的延迟直方图 */
+struct ramdisk_lat {
+	atomic64_t buckets[LAT_BUCKETS];	/* 落在每个区间的I/O数量 */
+	atomic64_t total_ns;				/* 总延迟 */
+	atomic64_t max_ns;					/* 最大延迟 */
+};
+
+/* 压缩后的页，len为0表示同值页，只保存填充值；len为PAGE_SIZE表示压缩不划算，
+ * 原始数据保存在单独分配的page中，这个结构体只是一个很小的头 */
+struct ramdisk_zpage {
+	unsigned int len;			/* 压缩后数据的长度 */
+	unsigned int size;			/* 实际占用的内存，kmalloc的ksize加上单独分配的页 */
+	unsigned long element;		/* 同值页的填充值 */
+	struct page *page;			/* 不可压缩页的原始数据 */
+	u8 data[0];					/* 压缩后的数据 */
+};
+
+/* 头加上压缩数据超过半页时，kmalloc会从kmalloc-4096甚至更大的slab中分配，
+ * 比直接保存一页还要多占内存，这种页按不可压缩页保存 */
+#define ZPAGE_OBJ_MAX	(PAGE_SIZE / 2)
+
+/* 压缩算法操作函数 */
+struct ramdisk_comp_ops {
+	const char *name;
+	size_t wrkmem_size;			/* 压缩时需要的工作内存大小 */
+	int (*compress)(const unsigned char *src, unsigned char *dst, size_t *dst_len, void *wrkmem);
+	int (*decompress)(const unsigned char *src, size_t src_len, unsigned char *dst);
+};
+
+/* 压缩统计信息，通过sysfs导出 */
+struct ramdisk_zstats {
+	atomic64_t pages_stored;	/* 保存的页数 */
+	atomic64_t compr_data_size;	/* 压缩后数据的总大小，不包括分配器的开销 */
+	atomic64_t mem_used;		/* 实际占用的内存 */
+	atomic64_t same_pages;		/* 同值页数量 */
+	atomic64_t huge_pages;		/* 不可压缩页数量 */
+	atomic64_t num_comp;		/* 压缩次数 */
+	atomic64_t comp_ns;			/* 压缩总耗时 */
+	atomic64_t num_decomp;		/* 解压次数 */
+	atomic64_t decomp_ns;		/* 解压总耗时 */
+};
 
 /* ramdisk设备结构体 */
 struct ramdisk_dev{
 	int major;      /* 主设备号 */
 	struct gendisk *gendisk;  /* 请求队列 */
 	struct request_queue *queue;   /* gendisk */
-	spinlock_t lock;  /* 自旋锁 */
-	unsigned char *ramdiskbuf;   /* ramdisk内存空间,用于模拟块设备 */     
+	spinlock_t lock;  /* 自旋锁，只在修改pages时使用，查找使用RCU */
+	struct radix_tree_root pages;   /* ramdisk内存空间，以页号为索引保存写过的页，参考brd.c(drivers/block/brd.c) */
+	sector_t capacity;   /* 容量，单位为扇区 */
+
+	/* 压缩模式使用，参考zram(drivers/block/zram/zram_drv.c) */
+	struct radix_tree_root zpages;   /* 以页号为索引保存压缩后的页 */
+	struct mutex zlock;   /* 保护zpages以及下面的缓冲区，i.MX6ULL是单核，一个压缩流就够了 */
+	const struct ramdisk_comp_ops *comp;   /* 压缩算法 */
+	void *wrkmem;   /* 压缩工作内存 */
+	void *zbuf;     /* 压缩输出缓冲区，两页大小 */
+	void *pagebuf;  /* 读改写使用的一页缓冲区 */
+	struct ramdisk_zstats stats;   /* 压缩统计信息 */
+
+	struct ramdisk_lat lat[RAMDISK_OP_NUM];   /* 每种I/O类型的延迟直方图 */
+	struct dentry *debugfs;   /* debugfs目录 */
 };
 
 struct ramdisk_dev ramdisk;
@@ -67,12 +217,15 @@ void ramdisk_release (struct gendisk *gendisk, fmode_t mode)
 int ramdisk_getgeo (struct block_device *dev, struct hd_geometry *geo)
 {
 	/* 这是相对于机械硬盘的概念 */
-	geo->heads = 2;			/* 磁头 */
-	geo->cylinders = 32;	/* 柱面 */
-	geo->sectors = RAMDISK_SIZE / (2 * 32 *512); /* 一个磁道上的扇区数量 */
+	geo->heads = 4;			/* 磁头 */
+	geo->sectors = 16;		/* 一个磁道上的扇区数量 */
+	geo->cylinders = min_t(sector_t, ramdisk.capacity / (4 * 16), 0xffff);	/* 柱面 */
 	return 0;
 }
 
+static long ramdisk_direct_access(struct block_device *bdev, sector_t sector,
+			void **kaddr, unsigned long *pfn, long size);
+
 /* 
  * 块设备操作函数 
  */
@@ -82,8 +235,1189 @@ static struct block_device_operations ramdisk_fops=
 	.open=ramdisk_open,
 	.release=ramdisk_release,
 	.getgeo=ramdisk_getgeo,
+	.direct_access=ramdisk_direct_access,   /* 没有开启dax的时候在加载函数中清除 */
 };
 
+/*
+ * @description	: 查找扇区所在的页，查找不需要加锁，多个CPU可以并行查找。
+ *				  返回的页只有在dax模式下(页不会被释放)或者调用者处于
+ *				  RCU读临界区内时才能安全访问
+ * @param-sector: 扇区地址
+ * @return 		: 找到的页，没有分配过的话返回NULL
+ */
+static struct page *ramdisk_lookup_page(sector_t sector)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;	/* 页号 */
+	struct page *page;
+
+	rcu_read_lock();
+	page = radix_tree_lookup(&ramdisk.pages, idx);
+	rcu_read_unlock();
+
+	return page;
+}
+
+/*
+ * @description	: 查找扇区所在的页，没有的话就分配一个清零的页并插入radix树
+ * @param-sector: 扇区地址
+ * @return 		: 页，内存不足时返回NULL
+ */
+static struct page *ramdisk_insert_page(sector_t sector)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	struct page *page;
+	gfp_t gfp_flags;
+
+	page = ramdisk_lookup_page(sector);
+	if (page)
+		return page;
+
+	/* I/O路径上分配内存不能再发起I/O，所以使用GFP_NOIO。
+	 * 数据都通过kmap_atomic访问，所以页可以分配在高端内存，
+	 * 但是DAX需要页有固定的内核地址
+	 */
+	gfp_flags = GFP_NOIO | __GFP_ZERO;
+	if (!dax)
+		gfp_flags |= __GFP_HIGHMEM;
+	page = alloc_page(gfp_flags);
+	if (!page)
+		return NULL;
+
+	if (radix_tree_preload(GFP_NOIO)) {
+		__free_page(page);
+		return NULL;
+	}
+
+	/* 插入时才加锁，两个上下文同时分配同一页的话，后插入的使用已有的页 */
+	spin_lock(&ramdisk.lock);
+	page->index = idx;
+	if (radix_tree_insert(&ramdisk.pages, idx, page)) {
+		/* 其他上下文已经插入了这个页，使用已有的 */
+		__free_page(page);
+		page = radix_tree_lookup(&ramdisk.pages, idx);
+	}
+	spin_unlock(&ramdisk.lock);
+
+	radix_tree_preload_end();
+
+	return page;
+}
+
+/*
+ * @description	: 释放所有已分配的页
+ * @param 		: 无
+ * @return 		: 无
+ */
+static void ramdisk_free_pages(void)
+{
+	unsigned long pos = 0;
+	struct page *pages[FREE_BATCH];
+	int nr_pages, i;
+
+	do {
+		nr_pages = radix_tree_gang_lookup(&ramdisk.pages, (void **)pages, pos, FREE_BATCH);
+		for (i = 0; i < nr_pages; i++) {
+			pos = pages[i]->index;
+			radix_tree_delete(&ramdisk.pages, pos);
+			__free_page(pages[i]);
+		}
+		pos++;
+	} while (nr_pages == FREE_BATCH);
+}
+
+/*
+ * @description	: RCU回调，所有读者都退出临界区后再真正释放页
+ * @param-head 	: 页中的rcu_head
+ * @return 		: 无
+ */
+static void ramdisk_free_page_rcu(struct rcu_head *head)
+{
+	__free_page(container_of(head, struct page, rcu_head));
+}
+
+/*
+ * @description	: 释放扇区所在的页，页被删除后再读就返回0。
+ *				  其他CPU可能正在RCU临界区内访问这个页，所以延迟释放
+ * @param-sector: 扇区地址
+ * @return 		: 无
+ */
+static void ramdisk_free_page(sector_t sector)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	struct page *page;
+
+	spin_lock(&ramdisk.lock);
+	page = radix_tree_delete(&ramdisk.pages, idx);
+	spin_unlock(&ramdisk.lock);
+
+	if (page)
+		call_rcu(&page->rcu_head, ramdisk_free_page_rcu);
+}
+
+/*
+ * @description	: 把扇区所在页中的一段清零，没有分配过的页本来就是0
+ * @param-sector: 扇区地址
+ * @param-n 	: 长度，不能跨页
+ * @return 		: 无
+ */
+static void ramdisk_zero_range(sector_t sector, size_t n)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << 9;
+	struct page *page;
+	void *mem;
+
+	rcu_read_lock();
+	page = radix_tree_lookup(&ramdisk.pages, sector >> PAGE_SECTORS_SHIFT);
+	if (page) {
+		mem = kmap_atomic(page);
+		memset(mem + offset, 0, n);
+		kunmap_atomic(mem);
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * @description	: 处理discard请求，整页直接释放，归还给系统，
+ *				  不满一页的部分清零，保证discard之后读回来的数据为0。
+ *				  开启dax时页可能被映射到用户空间，只能清零不能释放
+ * @param-sector: 起始扇区
+ * @param-n 	: 长度
+ * @return 		: 无
+ */
+static void discard_from_ramdisk(sector_t sector, size_t n)
+{
+	unsigned int offset;
+	size_t len;
+
+	while (n > 0) {
+		offset = (sector & (PAGE_SECTORS - 1)) << 9;
+		len = min_t(size_t, n, PAGE_SIZE - offset);
+
+		if (len == PAGE_SIZE && !dax)
+			ramdisk_free_page(sector);
+		else
+			ramdisk_zero_range(sector, len);
+
+		sector += len >> 9;
+		n -= len;
+	}
+}
+
+/*
+ * @description	: 拷贝一页内的数据，整页并且地址都页对齐的时候使用copy_page
+ * @param-dst 	: 目的地址
+ * @param-src 	: 源地址
+ * @param-n 	: 数据长度
+ * @return 		: 无
+ */
+static inline void ramdisk_memcpy(void *dst, const void *src, size_t n)
+{
+	if (n == PAGE_SIZE && IS_ALIGNED((unsigned long)dst | (unsigned long)src, PAGE_SIZE))
+		copy_page(dst, (void *)src);
+	else
+		memcpy(dst, src, n);
+}
+
+/*
+ * @description	: 写数据之前先分配好要用到的页，因为分配内存可能睡眠，
+ *				  不能在kmap_atomic之后进行
+ * @param-sector: 扇区地址
+ * @param-n 	: 数据长度
+ * @return 		: 0 成功;其他 失败
+ */
+static int copy_to_ramdisk_setup(sector_t sector, size_t n)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << 9;	/* 页内偏移 */
+	size_t copy = min_t(size_t, n, PAGE_SIZE - offset);
+
+	if (!ramdisk_insert_page(sector))
+		return -ENOMEM;
+	if (copy < n) {		/* 数据跨越两个页 */
+		sector += copy >> 9;
+		if (!ramdisk_insert_page(sector))
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * @description	: 在RCU读临界区内拷贝一页之内的数据，拷贝期间页不会被释放
+ * @param-buf 	: 读的时候为目的地址，写的时候为源地址
+ * @param-sector: 扇区地址
+ * @param-n 	: 数据长度，不能跨页
+ * @param-rw 	: 读或者写
+ * @return 		: 0 成功;-EAGAIN 写的时候页已经被discard释放
+ */
+static int ramdisk_copy_chunk(void *buf, sector_t sector, size_t n, int rw)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << 9;	/* 页内偏移 */
+	struct page *page;
+	void *mem;
+	int err = 0;
+
+	rcu_read_lock();
+	page = radix_tree_lookup(&ramdisk.pages, sector >> PAGE_SECTORS_SHIFT);
+	if (page) {
+		mem = kmap_atomic(page);
+		if (rw == READ)
+			ramdisk_memcpy(buf, mem + offset, n);
+		else
+			ramdisk_memcpy(mem + offset, buf, n);
+		kunmap_atomic(mem);
+	} else if (rw == READ) {
+		memset(buf, 0, n);		/* 没有写过的页读出来为0 */
+	} else {
+		err = -EAGAIN;
+	}
+	rcu_read_unlock();
+
+	return err;
+}
+
+/*
+ * @description	: 把数据写入ramdisk，数据可能跨越两个页，页已经由copy_to_ramdisk_setup分配
+ * @param-src 	: 要写入的数据
+ * @param-sector: 扇区地址
+ * @param-n 	: 数据长度
+ * @return 		: 0 成功;-EAGAIN 页被同时进行的discard释放了，需要重新分配
+ */
+static int copy_to_ramdisk(const void *src, sector_t sector, size_t n)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << 9;	/* 页内偏移 */
+	size_t copy = min_t(size_t, n, PAGE_SIZE - offset);
+	int err;
+
+	err = ramdisk_copy_chunk((void *)src, sector, copy, WRITE);
+	if (err || copy == n)
+		return err;
+
+	/* 剩下的数据在下一页 */
+	return ramdisk_copy_chunk((void *)src + copy, sector + (copy >> 9), n - copy, WRITE);
+}
+
+/*
+ * @description	: 从ramdisk读取数据，没有写过的页直接返回0，不分配内存
+ * @param-dst 	: 读取到的数据
+ * @param-sector: 扇区地址
+ * @param-n 	: 数据长度
+ * @return 		: 无
+ */
+static void copy_from_ramdisk(void *dst, sector_t sector, size_t n)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << 9;
+	size_t copy = min_t(size_t, n, PAGE_SIZE - offset);
+
+	ramdisk_copy_chunk(dst, sector, copy, READ);
+	if (copy < n)
+		ramdisk_copy_chunk(dst + copy, sector + (copy >> 9), n - copy, READ);
+}
+
+/*
+ * @description	: 处理bio中的一个段，读写都不需要加锁，不同扇区的I/O可以在多个CPU上并行
+ * @param-page 	: 段所在的页
+ * @param-len 	: 段长度
+ * @param-off 	: 段在页内的偏移
+ * @param-rw 	: 读或者写
+ * @param-sector: 扇区地址
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_do_bvec(struct page *page, unsigned int len,
+			unsigned int off, int rw, sector_t sector)
+{
+	void *mem;
+	int err = 0;
+
+	if (rw == READ) {
+		mem = kmap_atomic(page);    /* bio中的页也可能位于高端内存，不能直接使用page_address */
+		copy_from_ramdisk(mem + off, sector, len);
+		flush_dcache_page(page);
+		kunmap_atomic(mem);
+		return 0;
+	}
+
+	do {
+		err = copy_to_ramdisk_setup(sector, len);
+		if (err)
+			return err;
+
+		mem = kmap_atomic(page);
+		flush_dcache_page(page);
+		err = copy_to_ramdisk(mem + off, sector, len);
+		kunmap_atomic(mem);
+	} while (err == -EAGAIN);	/* 和discard并发时页可能刚被释放，重新分配后再写 */
+
+	return err;
+}
+
+/*
+ * @description	: DAX直接访问，返回扇区所在页的内核地址和页帧号，
+ *				  文件系统(比如ext2 -o dax)可以直接映射这些页，不经过页缓存
+ * @param-bdev 	: 块设备
+ * @param-sector: 扇区地址，必须页对齐
+ * @param-kaddr : 返回的内核地址
+ * @param-pfn 	: 返回的页帧号
+ * @param-size 	: 请求的长度
+ * @return 		: 可以直接访问的长度;负值 失败
+ */
+static long ramdisk_direct_access(struct block_device *bdev, sector_t sector,
+			void **kaddr, unsigned long *pfn, long size)
+{
+	struct page *page;
+
+	if (sector & (PAGE_SECTORS - 1))
+		return -EINVAL;
+	if (sector + PAGE_SECTORS > ramdisk.capacity)
+		return -ERANGE;
+
+	page = ramdisk_insert_page(sector);
+	if (!page)
+		return -ENOSPC;
+	*kaddr = page_address(page);
+	*pfn = page_to_pfn(page);
+
+	return PAGE_SIZE;
+}
+
+static int ramdisk_lzo_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *wrkmem)
+{
+	return lzo1x_1_compress(src, PAGE_SIZE, dst, dst_len, wrkmem) == LZO_E_OK ? 0 : -EINVAL;
+}
+
+static int ramdisk_lzo_decompress(const unsigned char *src, size_t src_len, unsigned char *dst)
+{
+	size_t dst_len = PAGE_SIZE;
+
+	return lzo1x_decompress_safe(src, src_len, dst, &dst_len) == LZO_E_OK ? 0 : -EINVAL;
+}
+
+static int ramdisk_lz4_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *wrkmem)
+{
+	return lz4_compress(src, PAGE_SIZE, dst, dst_len, wrkmem) ? -EINVAL : 0;
+}
+
+static int ramdisk_lz4_decompress(const unsigned char *src, size_t src_len, unsigned char *dst)
+{
+	size_t dst_len = PAGE_SIZE;
+
+	return lz4_decompress_unknownoutputsize(src, src_len, dst, &dst_len) ? -EINVAL : 0;
+}
+
+/* 支持的压缩算法 */
+static const struct ramdisk_comp_ops ramdisk_comp_ops[] = {
+	{ "lzo", LZO1X_1_MEM_COMPRESS, ramdisk_lzo_compress, ramdisk_lzo_decompress },
+	{ "lz4", LZ4_MEM_COMPRESS, ramdisk_lz4_compress, ramdisk_lz4_decompress },
+};
+
+/*
+ * @description	: 判断一页是否所有的字都相同，比如全0的页
+ * @param-ptr 	: 页数据
+ * @param-element: 返回填充值
+ * @return 		: true 同值页;false 不是
+ */
+static bool ramdisk_page_same_filled(const void *ptr, unsigned long *element)
+{
+	const unsigned long *page = ptr;
+	unsigned int pos;
+
+	for (pos = 1; pos < PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
+			return false;
+	}
+	*element = page[0];
+	return true;
+}
+
+/*
+ * @description	: 释放压缩页占用的内存，不修改统计信息
+ * @param-zpage : 压缩页
+ * @return 		: 无
+ */
+static void ramdisk_zpage_release(struct ramdisk_zpage *zpage)
+{
+	if (zpage->page)
+		__free_page(zpage->page);
+	kfree(zpage);
+}
+
+/*
+ * @description	: 释放一个压缩页，同时更新统计信息
+ * @param-zpage : 压缩页
+ * @return 		: 无
+ */
+static void ramdisk_zfree(struct ramdisk_zpage *zpage)
+{
+	if (!zpage)
+		return;
+
+	if (zpage->len == 0)
+		atomic64_dec(&ramdisk.stats.same_pages);
+	else if (zpage->len == PAGE_SIZE)
+		atomic64_dec(&ramdisk.stats.huge_pages);
+	atomic64_sub(zpage->len, &ramdisk.stats.compr_data_size);
+	atomic64_sub(zpage->size, &ramdisk.stats.mem_used);
+	atomic64_dec(&ramdisk.stats.pages_stored);
+	ramdisk_zpage_release(zpage);
+}
+
+/*
+ * @description	: 读取一个页的数据，没有保存过的页返回0，调用时需要持有zlock
+ * @param-idx 	: 页号
+ * @param-dst 	: 一页大小的输出缓冲区
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_zload(pgoff_t idx, void *dst)
+{
+	struct ramdisk_zpage *zpage;
+	unsigned long *page = dst;
+	unsigned int pos;
+	ktime_t start;
+	void *mem;
+	int ret;
+
+	zpage = radix_tree_lookup(&ramdisk.zpages, idx);
+	if (!zpage) {
+		memset(dst, 0, PAGE_SIZE);
+		return 0;
+	}
+
+	if (zpage->len == 0) {		/* 同值页 */
+		for (pos = 0; pos < PAGE_SIZE / sizeof(*page); pos++)
+			page[pos] = zpage->element;
+		return 0;
+	}
+
+	if (zpage->len == PAGE_SIZE) {	/* 不可压缩页 */
+		mem = kmap_atomic(zpage->page);
+		memcpy(dst, mem, PAGE_SIZE);
+		kunmap_atomic(mem);
+		return 0;
+	}
+
+	start = ktime_get();
+	ret = ramdisk.comp->decompress(zpage->data, zpage->len, dst);
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)), &ramdisk.stats.decomp_ns);
+	atomic64_inc(&ramdisk.stats.num_decomp);
+	if (ret)
+		printk("ramdisk: decompress page %lu failed\r\n", idx);
+
+	return ret;
+}
+
+/*
+ * @description	: 压缩并保存一个页，替换原来的数据，调用时需要持有zlock
+ * @param-idx 	: 页号
+ * @param-src 	: 一页大小的数据
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_zstore(pgoff_t idx, const void *src)
+{
+	struct ramdisk_zpage *zpage, *old;
+	unsigned long element = 0;
+	struct page *page = NULL;
+	size_t clen = 0;
+	void **slot;
+	ktime_t start;
+	void *mem;
+	int ret;
+
+	if (ramdisk_page_same_filled(src, &element)) {
+		clen = 0;
+	} else {
+		start = ktime_get();
+		ret = ramdisk.comp->compress(src, ramdisk.zbuf, &clen, ramdisk.wrkmem);
+		atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)), &ramdisk.stats.comp_ns);
+		atomic64_inc(&ramdisk.stats.num_comp);
+		if (ret || sizeof(*zpage) + clen > ZPAGE_OBJ_MAX)	/* 压缩后不能省内存，直接保存原始数据 */
+			clen = PAGE_SIZE;
+	}
+
+	if (clen == PAGE_SIZE) {
+		/* 原始数据单独放在一页中，可以使用高端内存，头从小的slab中分配 */
+		page = alloc_page(GFP_NOIO | __GFP_NOWARN | __GFP_HIGHMEM);
+		if (!page)
+			return -ENOMEM;
+		mem = kmap_atomic(page);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(mem);
+		zpage = kmalloc(sizeof(*zpage), GFP_NOIO | __GFP_NOWARN);
+	} else {
+		zpage = kmalloc(sizeof(*zpage) + clen, GFP_NOIO | __GFP_NOWARN);
+		if (zpage && clen)
+			memcpy(zpage->data, ramdisk.zbuf, clen);
+	}
+	if (!zpage) {
+		if (page)
+			__free_page(page);
+		return -ENOMEM;
+	}
+	zpage->len = clen;
+	zpage->element = element;
+	zpage->page = page;
+	zpage->size = ksize(zpage) + (page ? PAGE_SIZE : 0);   /* 按分配器实际分配的大小统计 */
+
+	/* 替换radix树中原来的页 */
+	slot = radix_tree_lookup_slot(&ramdisk.zpages, idx);
+	if (slot) {
+		old = radix_tree_deref_slot(slot);
+		radix_tree_replace_slot(slot, zpage);
+		ramdisk_zfree(old);
+	} else {
+		if (radix_tree_preload(GFP_NOIO)) {
+			ramdisk_zpage_release(zpage);
+			return -ENOMEM;
+		}
+		ret = radix_tree_insert(&ramdisk.zpages, idx, zpage);
+		radix_tree_preload_end();
+		if (ret) {
+			ramdisk_zpage_release(zpage);
+			return ret;
+		}
+	}
+
+	atomic64_inc(&ramdisk.stats.pages_stored);
+	atomic64_add(clen, &ramdisk.stats.compr_data_size);
+	atomic64_add(zpage->size, &ramdisk.stats.mem_used);
+	if (clen == 0)
+		atomic64_inc(&ramdisk.stats.same_pages);
+	else if (clen == PAGE_SIZE)
+		atomic64_inc(&ramdisk.stats.huge_pages);
+	return 0;
+}
+
+/*
+ * @description	: 压缩模式下处理bio中的一个段，不满一页的写需要先解压，修改后再压缩
+ * @param-page 	: 段所在的页
+ * @param-len 	: 段长度
+ * @param-off 	: 段在页内的偏移
+ * @param-rw 	: 读或者写
+ * @param-sector: 扇区地址
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_zdo_bvec(struct page *page, unsigned int len,
+			unsigned int off, int rw, sector_t sector)
+{
+	pgoff_t idx;
+	unsigned int offset, n;
+	void *mem;
+	int err = 0;
+
+	mutex_lock(&ramdisk.zlock);
+	mem = kmap(page) + off;    /* 保存时需要分配内存，可能睡眠，所以不能用kmap_atomic */
+
+	while (len && !err) {
+		idx = sector >> PAGE_SECTORS_SHIFT;
+		offset = (sector & (PAGE_SECTORS - 1)) << 9;
+		n = min_t(unsigned int, len, PAGE_SIZE - offset);
+
+		if (rw == READ) {
+			if (n == PAGE_SIZE) {
+				err = ramdisk_zload(idx, mem);
+			} else {
+				err = ramdisk_zload(idx, ramdisk.pagebuf);
+				memcpy(mem, ramdisk.pagebuf + offset, n);
+			}
+		} else {
+			if (n == PAGE_SIZE) {
+				err = ramdisk_zstore(idx, mem);
+			} else {
+				err = ramdisk_zload(idx, ramdisk.pagebuf);
+				memcpy(ramdisk.pagebuf + offset, mem, n);
+				if (!err)
+					err = ramdisk_zstore(idx, ramdisk.pagebuf);
+			}
+		}
+
+		mem += n;
+		sector += n >> 9;
+		len -= n;
+	}
+
+	if (rw == READ)
+		flush_dcache_page(page);
+	kunmap(page);
+	mutex_unlock(&ramdisk.zlock);
+
+	return err;
+}
+
+/*
+ * @description	: 压缩模式下处理discard，整页直接删除，不满一页的部分清零。
+ *				  清零后重新保存失败时原来的页保持不变，返回错误让这个discard失败
+ * @param-sector: 起始扇区
+ * @param-n 	: 长度
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_zdiscard(sector_t sector, size_t n)
+{
+	pgoff_t idx;
+	unsigned int offset;
+	size_t len;
+	int err = 0;
+
+	mutex_lock(&ramdisk.zlock);
+	while (n > 0 && !err) {
+		idx = sector >> PAGE_SECTORS_SHIFT;
+		offset = (sector & (PAGE_SECTORS - 1)) << 9;
+		len = min_t(size_t, n, PAGE_SIZE - offset);
+
+		if (len == PAGE_SIZE) {
+			ramdisk_zfree(radix_tree_delete(&ramdisk.zpages, idx));
+		} else if (radix_tree_lookup(&ramdisk.zpages, idx)) {
+			err = ramdisk_zload(idx, ramdisk.pagebuf);
+			if (!err) {
+				memset(ramdisk.pagebuf + offset, 0, len);
+				err = ramdisk_zstore(idx, ramdisk.pagebuf);
+			}
+		}
+
+		sector += len >> 9;
+		n -= len;
+	}
+	mutex_unlock(&ramdisk.zlock);
+
+	return err;
+}
+
+/*
+ * @description	: 释放所有压缩页
+ * @param 		: 无
+ * @return 		: 无
+ */
+static void ramdisk_zfree_pages(void)
+{
+	unsigned long pos = 0;
+	struct ramdisk_zpage *zpages[FREE_BATCH];
+	unsigned long indices[FREE_BATCH];
+	void **slots[FREE_BATCH];
+	int nr, i;
+
+	do {
+		nr = radix_tree_gang_lookup_slot(&ramdisk.zpages, slots, indices, pos, FREE_BATCH);
+		for (i = 0; i < nr; i++)
+			zpages[i] = radix_tree_deref_slot(slots[i]);
+		for (i = 0; i < nr; i++) {
+			pos = indices[i];
+			radix_tree_delete(&ramdisk.zpages, pos);
+			ramdisk_zfree(zpages[i]);
+		}
+		pos++;
+	} while (nr == FREE_BATCH);
+}
+
+/*
+ * @description	: sysfs读取压缩统计信息，文件位于/sys/block/ramdisk/下
+ */
+static ssize_t orig_data_size_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n",
+		(u64)atomic64_read(&ramdisk.stats.pages_stored) << PAGE_SHIFT);
+}
+
+static ssize_t compr_data_size_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", (u64)atomic64_read(&ramdisk.stats.compr_data_size));
+}
+
+/* 实际占用的内存，包括kmalloc的对齐开销和不可压缩页 */
+static ssize_t mem_used_total_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", (u64)atomic64_read(&ramdisk.stats.mem_used));
+}
+
+static ssize_t same_pages_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", (u64)atomic64_read(&ramdisk.stats.same_pages));
+}
+
+static ssize_t huge_pages_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", (u64)atomic64_read(&ramdisk.stats.huge_pages));
+}
+
+/* 压缩率，原始大小/实际占用的内存，放大100倍，小于100说明压缩反而多用了内存 */
+static ssize_t compr_ratio_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	u64 orig = (u64)atomic64_read(&ramdisk.stats.pages_stored) << PAGE_SHIFT;
+	u64 used = atomic64_read(&ramdisk.stats.mem_used);
+
+	return sprintf(buf, "%llu\n", used ? div64_u64(orig * 100, used) : 0);
+}
+
+/* 压缩和解压的平均耗时，单位ns */
+static ssize_t comp_time_ns_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	u64 num = atomic64_read(&ramdisk.stats.num_comp);
+
+	return sprintf(buf, "%llu\n",
+		num ? div64_u64(atomic64_read(&ramdisk.stats.comp_ns), num) : 0);
+}
+
+static ssize_t decomp_time_ns_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	u64 num = atomic64_read(&ramdisk.stats.num_decomp);
+
+	return sprintf(buf, "%llu\n",
+		num ? div64_u64(atomic64_read(&ramdisk.stats.decomp_ns), num) : 0);
+}
+
+static DEVICE_ATTR_RO(orig_data_size);
+static DEVICE_ATTR_RO(compr_data_size);
+static DEVICE_ATTR_RO(mem_used_total);
+static DEVICE_ATTR_RO(same_pages);
+static DEVICE_ATTR_RO(huge_pages);
+static DEVICE_ATTR_RO(compr_ratio);
+static DEVICE_ATTR_RO(comp_time_ns);
+static DEVICE_ATTR_RO(decomp_time_ns);
+
+static struct attribute *ramdisk_zattrs[] = {
+	&dev_attr_orig_data_size.attr,
+	&dev_attr_compr_data_size.attr,
+	&dev_attr_mem_used_total.attr,
+	&dev_attr_same_pages.attr,
+	&dev_attr_huge_pages.attr,
+	&dev_attr_compr_ratio.attr,
+	&dev_attr_comp_time_ns.attr,
+	&dev_attr_decomp_time_ns.attr,
+	NULL,
+};
+
+static const struct attribute_group ramdisk_zattr_group = {
+	.attrs = ramdisk_zattrs,
+};
+
+/*
+ * @description	: 初始化压缩模式，选择压缩算法并申请缓冲区
+ * @param 		: 无
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_zinit(void)
+{
+	int i;
+
+	INIT_RADIX_TREE(&ramdisk.zpages, GFP_ATOMIC);
+	mutex_init(&ramdisk.zlock);
+
+	for (i = 0; i < ARRAY_SIZE(ramdisk_comp_ops); i++) {
+		if (!strcmp(comp_algorithm, ramdisk_comp_ops[i].name))
+			ramdisk.comp = &ramdisk_comp_ops[i];
+	}
+	if (!ramdisk.comp) {
+		printk("ramdisk: unknown compression algorithm %s\r\n", comp_algorithm);
+		return -EINVAL;
+	}
+
+	ramdisk.wrkmem = kmalloc(ramdisk.comp->wrkmem_size, GFP_KERNEL);
+	ramdisk.zbuf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+	ramdisk.pagebuf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!ramdisk.wrkmem || !ramdisk.zbuf || !ramdisk.pagebuf) {
+		kfree(ramdisk.wrkmem);
+		kfree(ramdisk.zbuf);
+		kfree(ramdisk.pagebuf);
+		return -ENOMEM;
+	}
+
+	printk("ramdisk compress with %s\r\n", ramdisk.comp->name);
+	return 0;
+}
+
+/*
+ * @description	: 释放压缩模式使用的所有内存
+ * @param 		: 无
+ * @return 		: 无
+ */
+static void ramdisk_zexit(void)
+{
+	ramdisk_zfree_pages();
+	kfree(ramdisk.wrkmem);
+	kfree(ramdisk.zbuf);
+	kfree(ramdisk.pagebuf);
+}
+
+/*
+ * @description	: 从pos开始查找已经分配的页号，用于快照
+ * @param-pos 	: 起始页号
+ * @param-indices: 返回的页号
+ * @param-max 	: 最多返回的数量
+ * @return 		: 找到的页数
+ */
+static int ramdisk_snap_lookup(unsigned long pos, unsigned long *indices, int max)
+{
+	struct page *pages[SNAP_BATCH];
+	void **slots[SNAP_BATCH];
+	int nr, i;
+
+	if (compress) {
+		mutex_lock(&ramdisk.zlock);
+		nr = radix_tree_gang_lookup_slot(&ramdisk.zpages, slots, indices, pos, max);
+		mutex_unlock(&ramdisk.zlock);
+		return nr;
+	}
+
+	rcu_read_lock();
+	nr = radix_tree_gang_lookup(&ramdisk.pages, (void **)pages, pos, max);
+	for (i = 0; i < nr; i++)
+		indices[i] = pages[i]->index;
+	rcu_read_unlock();
+	return nr;
+}
+
+/*
+ * @description	: 读取一页数据保存到快照中
+ * @param-idx 	: 页号
+ * @param-dst 	: 一页大小的缓冲区
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_snap_read_page(pgoff_t idx, void *dst)
+{
+	int err = 0;
+
+	if (compress) {
+		mutex_lock(&ramdisk.zlock);
+		err = ramdisk_zload(idx, dst);
+		mutex_unlock(&ramdisk.zlock);
+	} else {
+		copy_from_ramdisk(dst, (sector_t)idx << PAGE_SECTORS_SHIFT, PAGE_SIZE);
+	}
+	return err;
+}
+
+/*
+ * @description	: 把快照中的一页数据写入ramdisk
+ * @param-idx 	: 页号
+ * @param-src 	: 一页数据
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_snap_write_page(pgoff_t idx, const void *src)
+{
+	sector_t sector = (sector_t)idx << PAGE_SECTORS_SHIFT;
+	int err;
+
+	if (compress) {
+		mutex_lock(&ramdisk.zlock);
+		err = ramdisk_zstore(idx, src);
+		mutex_unlock(&ramdisk.zlock);
+		return err;
+	}
+
+	do {
+		err = copy_to_ramdisk_setup(sector, PAGE_SIZE);
+		if (!err)
+			err = copy_to_ramdisk(src, sector, PAGE_SIZE);
+	} while (err == -EAGAIN);
+	return err;
+}
+
+/*
+ * @description	: 把所有分配过的页流式写入快照文件，每次写SNAP_BATCH条记录，
+ *				  最后再写文件头。做快照时磁盘上不应该有写操作，比如先卸载文件系统
+ * @param-path 	: 快照文件路径
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_snapshot(const char *path)
+{
+	struct ramdisk_snap_hdr hdr;
+	struct ramdisk_snap_rec *rec;
+	unsigned long indices[SNAP_BATCH];
+	unsigned long pos = 0;
+	u64 nr_pages = 0;
+	loff_t off = sizeof(hdr);
+	struct file *filp;
+	void *buf;
+	ssize_t len;
+	int nr, i, err = 0;
+
+	buf = vmalloc(SNAP_BATCH * SNAP_REC_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	filp = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+	if (IS_ERR(filp)) {
+		vfree(buf);
+		return PTR_ERR(filp);
+	}
+
+	do {
+		nr = ramdisk_snap_lookup(pos, indices, SNAP_BATCH);
+		for (i = 0; i < nr; i++) {
+			rec = buf + i * SNAP_REC_SIZE;
+			err = ramdisk_snap_read_page(indices[i], rec + 1);
+			if (err)
+				goto out;
+			rec->index = cpu_to_le64(indices[i]);
+			rec->crc = cpu_to_le32(crc32(~0, rec + 1, PAGE_SIZE));
+			rec->reserved = 0;
+		}
+		if (nr) {
+			len = kernel_write(filp, buf, nr * SNAP_REC_SIZE, off);
+			if (len != nr * SNAP_REC_SIZE) {
+				err = len < 0 ? len : -EIO;
+				goto out;
+			}
+			off += len;
+			nr_pages += nr;
+			pos = indices[nr - 1] + 1;
+		}
+	} while (nr == SNAP_BATCH);
+
+	/* 所有页写完后再写文件头，文件头不对的话恢复时直接拒绝 */
+	hdr.magic = cpu_to_le32(SNAP_MAGIC);
+	hdr.version = cpu_to_le32(SNAP_VERSION);
+	hdr.page_size = cpu_to_le32(PAGE_SIZE);
+	hdr.hdr_crc = 0;
+	hdr.capacity = cpu_to_le64(ramdisk.capacity);
+	hdr.nr_pages = cpu_to_le64(nr_pages);
+	hdr.hdr_crc = cpu_to_le32(crc32(~0, &hdr, sizeof(hdr)));
+	len = kernel_write(filp, (char *)&hdr, sizeof(hdr), 0);
+	if (len != sizeof(hdr))
+		err = len < 0 ? len : -EIO;
+	else
+		err = vfs_fsync(filp, 0);
+
+	printk("ramdisk snapshot %llu pages to %s, ret = %d\r\n", nr_pages, path, err);
+out:
+	filp_close(filp, NULL);
+	vfree(buf);
+	return err;
+}
+
+/*
+ * @description	: 加载时从快照文件恢复数据，使用大块顺序读
+ * @param-path 	: 快照文件路径
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_restore(const char *path)
+{
+	struct ramdisk_snap_hdr hdr;
+	struct ramdisk_snap_rec *rec;
+	u64 nr_pages, done = 0;
+	loff_t off = sizeof(hdr);
+	struct file *filp;
+	u32 crc;
+	void *buf;
+	int nr, i, len, err = 0;
+
+	filp = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(filp))
+		return PTR_ERR(filp);
+
+	/* 检查文件头 */
+	len = kernel_read(filp, 0, (char *)&hdr, sizeof(hdr));
+	if (len != sizeof(hdr)) {
+		err = -EINVAL;
+		goto out_close;
+	}
+	crc = le32_to_cpu(hdr.hdr_crc);
+	hdr.hdr_crc = 0;
+	if (le32_to_cpu(hdr.magic) != SNAP_MAGIC || le32_to_cpu(hdr.version) != SNAP_VERSION ||
+		le32_to_cpu(hdr.page_size) != PAGE_SIZE || crc32(~0, &hdr, sizeof(hdr)) != crc ||
+		le64_to_cpu(hdr.capacity) > ramdisk.capacity) {
+		printk("ramdisk: invalid snapshot %s\r\n", path);
+		err = -EINVAL;
+		goto out_close;
+	}
+	nr_pages = le64_to_cpu(hdr.nr_pages);
+
+	buf = vmalloc(SNAP_BATCH * SNAP_REC_SIZE);
+	if (!buf) {
+		err = -ENOMEM;
+		goto out_close;
+	}
+
+	while (done < nr_pages) {
+		nr = min_t(u64, nr_pages - done, SNAP_BATCH);
+		len = kernel_read(filp, off, buf, nr * SNAP_REC_SIZE);
+		if (len != nr * SNAP_REC_SIZE) {
+			err = len < 0 ? len : -EIO;
+			break;
+		}
+		for (i = 0; i < nr && !err; i++) {
+			rec = buf + i * SNAP_REC_SIZE;
+			if (crc32(~0, rec + 1, PAGE_SIZE) != le32_to_cpu(rec->crc) ||
+				le64_to_cpu(rec->index) >= (ramdisk.capacity >> PAGE_SECTORS_SHIFT)) {
+				printk("ramdisk: snapshot record %llu corrupted\r\n", done + i);
+				err = -EINVAL;
+				break;
+			}
+			err = ramdisk_snap_write_page(le64_to_cpu(rec->index), rec + 1);
+		}
+		if (err)
+			break;
+		off += len;
+		done += nr;
+	}
+
+	printk("ramdisk restore %llu pages from %s, ret = %d\r\n", done, path, err);
+	vfree(buf);
+out_close:
+	filp_close(filp, NULL);
+	return err;
+}
+
+/*
+ * @description	: sysfs写snapshot文件触发快照，写入的内容为快照文件路径，
+ *				  比如echo /data/ramdisk.snap > /sys/block/ramdisk/snapshot
+ */
+static ssize_t snapshot_store(struct device *dev,
+			struct device_attribute *attr, const char *buf, size_t count)
+{
+	static DEFINE_MUTEX(snap_lock);		/* 同一时间只做一个快照 */
+	char *path;
+	int ret;
+
+	path = kstrndup(buf, count, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+	strim(path);
+	if (!*path) {
+		kfree(path);
+		return -EINVAL;
+	}
+
+	mutex_lock(&snap_lock);
+	ret = ramdisk_snapshot(path);
+	mutex_unlock(&snap_lock);
+
+	kfree(path);
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR(snapshot, S_IWUSR, NULL, snapshot_store);
+
+/*
+ * @description	: 记录一次I/O的延迟
+ * @param-op 	: I/O类型
+ * @param-start : I/O开始的时间
+ * @return 		: 无
+ */
+static void ramdisk_lat_account(enum ramdisk_op op, ktime_t start)
+{
+	struct ramdisk_lat *lat = &ramdisk.lat[op];
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	u64 max;
+	int bucket;
+
+	bucket = min_t(int, fls64(div_u64(ns, 1000)), LAT_BUCKETS - 1);   /* 按微秒取log2 */
+	atomic64_inc(&lat->buckets[bucket]);
+	atomic64_add(ns, &lat->total_ns);
+
+	max = atomic64_read(&lat->max_ns);
+	while (ns > max && atomic64_cmpxchg(&lat->max_ns, max, ns) != max)
+		max = atomic64_read(&lat->max_ns);
+}
+
+/*
+ * @description	: debugfs中的latency文件，输出每种I/O类型的延迟直方图
+ * @param-m 	: seq_file
+ * @param-v 	: 未使用
+ * @return 		: 0
+ */
+static int ramdisk_lat_show(struct seq_file *m, void *v)
+{
+	struct ramdisk_lat *lat;
+	u64 count, total;
+	int op, i;
+
+	for (op = 0; op < RAMDISK_OP_NUM; op++) {
+		lat = &ramdisk.lat[op];
+		count = 0;
+		for (i = 0; i < LAT_BUCKETS; i++)
+			count += atomic64_read(&lat->buckets[i]);
+		total = atomic64_read(&lat->total_ns);
+
+		seq_printf(m, "%s: count %llu avg_ns %llu max_ns %llu\n", ramdisk_op_name[op],
+			count, count ? div64_u64(total, count) : 0,
+			(u64)atomic64_read(&lat->max_ns));
+		for (i = 0; i < LAT_BUCKETS; i++) {
+			if (!atomic64_read(&lat->buckets[i]))
+				continue;
+			seq_printf(m, "  %8lu - %8lu us: %llu\n", i ? 1UL << (i - 1) : 0,
+				i == LAT_BUCKETS - 1 ? ULONG_MAX : 1UL << i,
+				(u64)atomic64_read(&lat->buckets[i]));
+		}
+	}
+	return 0;
+}
+
+static int ramdisk_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ramdisk_lat_show, NULL);
+}
+
+/*
+ * @description	: 向latency文件写任意内容清空统计数据
+ */
+static ssize_t ramdisk_lat_write(struct file *file, const char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	int op, i;
+
+	for (op = 0; op < RAMDISK_OP_NUM; op++) {
+		for (i = 0; i < LAT_BUCKETS; i++)
+			atomic64_set(&ramdisk.lat[op].buckets[i], 0);
+		atomic64_set(&ramdisk.lat[op].total_ns, 0);
+		atomic64_set(&ramdisk.lat[op].max_ns, 0);
+	}
+	return count;
+}
+
+static const struct file_operations ramdisk_lat_fops = {
+	.owner = THIS_MODULE,
+	.open = ramdisk_lat_open,
+	.read = seq_read,
+	.write = ramdisk_lat_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * @description	: 检查队列相关的模块参数，容量要按逻辑块大小对齐，所以在计算容量之前调用
+ * @param 		: 无
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_check_queue_params(void)
+{
+	if ((logical_block_size != 512 && logical_block_size != 4096) ||
+		(physical_block_size != 512 && physical_block_size != 4096) ||
+		physical_block_size < logical_block_size) {
+		printk("ramdisk: invalid block size %u/%u\r\n", logical_block_size, physical_block_size);
+		return -EINVAL;
+	}
+	if (max_sectors < (PAGE_SIZE >> 9) || max_segments == 0) {
+		printk("ramdisk: invalid max_sectors %u or max_segments %u\r\n", max_sectors, max_segments);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * @description	: 设置请求队列的限制，告诉文件系统和页缓存按块大小对齐
+ *				  并且尽量发出大的I/O，避免读改写和合并的开销，参数已经由ramdisk_check_queue_params检查过
+ * @param-q 	: 请求队列
+ * @return 		: 无
+ */
+static void ramdisk_set_queue_limits(struct request_queue *q)
+{
+	blk_queue_logical_block_size(q, logical_block_size);
+	blk_queue_physical_block_size(q, physical_block_size);
+	blk_queue_io_min(q, physical_block_size);		/* 最小I/O为一个物理块 */
+	blk_queue_io_opt(q, max_sectors << 9);			/* 最优I/O为一个最大请求 */
+	blk_queue_max_hw_sectors(q, max_sectors);
+	blk_queue_max_segments(q, max_segments);
+
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, q);		/* 非旋转设备，不需要寻道优化 */
+	queue_flag_clear_unlocked(QUEUE_FLAG_ADD_RANDOM, q);	/* 不为熵池贡献随机数 */
+}
+
 /*
  * @description	: “制造请求”函数--抛开 I/O 调度器
  * @param-q 	: 请求队列
@@ -91,27 +1425,61 @@ static struct block_device_operations ramdisk_fops=
  */
 void ramdisk_make_request_fn (struct request_queue *q, struct bio *bio)
 {
-	int offset;
+	sector_t sector;
 	struct bio_vec bvl;    /* RAM信息，比如页地址、页偏移以及长度，实际地址为页地址+页偏移 */
 	struct bvec_iter iter;  /* 变量就用于描述物理存储设备地址信息，比如要操作的扇区地址 */
-	unsigned long len = 0;
+	int err = 0;
+	int rw = bio_data_dir(bio);
+	bool stat = blk_queue_io_stat(q);
+	unsigned long start_time = jiffies;
+	ktime_t start = ktime_get();
+	enum ramdisk_op op;
+
+	if (bio->bi_rw & REQ_DISCARD)
+		op = RAMDISK_OP_DISCARD;
+	else
+		op = rw == READ ? RAMDISK_OP_READ : RAMDISK_OP_WRITE;
+
+	/* 不经过请求队列的驱动需要自己做I/O统计，参考zram */
+	if (stat)
+		generic_start_io_acct(rw, bio_sectors(bio), &ramdisk.gendisk->part0);
 
-	offset=(bio->bi_iter.bi_sector)<<9;    /* 由扇区偏移地址左移9位转换为字节地址(2^9=512字节) */
+	sector = bio->bi_iter.bi_sector;    /* 起始扇区 */
+	if (bio_end_sector(bio) > ramdisk.capacity) {	/* 越界检查 */
+		err = -EIO;
+		goto out;
+	}
+
+	/* discard请求不带数据，直接释放对应的页 */
+	if (unlikely(bio->bi_rw & REQ_DISCARD)) {
+		if (compress)
+			err = ramdisk_zdiscard(sector, bio->bi_iter.bi_size);
+		else
+			discard_from_ramdisk(sector, bio->bi_iter.bi_size);
+		if (!err)
+			set_bit(BIO_UPTODATE, &bio->bi_flags);
+		goto out;
+	}
 
 	bio_for_each_segment(bvl,bio,iter){  /* 遍历 bio 中的所有段，宏定义包括for循环*/
-		char *ptr = page_address(bvl.bv_page) + bvl.bv_offset;    /* 根据页地址以及偏移地址转换为真正的数据起始地址 */
-		len = bvl.bv_len;   /* 数据长度 */
-
-		if(bio_data_dir(bio) == READ)	/* 读数据 */
-			memcpy(ptr, ramdisk.ramdiskbuf + offset, len);  /* 目的、原数据、长度。ramdisk.ramdiskbuf为实际块设备地址 */
-		else if(bio_data_dir(bio) == WRITE)	/* 写数据 */
-			memcpy(ramdisk.ramdiskbuf + offset, ptr, len);
-		offset += len;   /* ramdisk.ramdiskbuf为实际块设备地址加上偏移长度 */
+		if (compress)
+			err = ramdisk_zdo_bvec(bvl.bv_page, bvl.bv_len, bvl.bv_offset,
+						bio_data_dir(bio), sector);
+		else
+			err = ramdisk_do_bvec(bvl.bv_page, bvl.bv_len, bvl.bv_offset,
+						bio_data_dir(bio), sector);
+		if (err)
+			goto out;
+		sector += bvl.bv_len >> 9;   /* 下一个段的扇区地址 */
 	}   
 	/* #define bio_for_each_segment(bvl, bio, iter)  __bio_for_each_segment(bvl, bio, iter, (bio)->bi_iter) */
 
 	set_bit(BIO_UPTODATE, &bio->bi_flags);  /* 参考 */
-	bio_endio(bio,0);  /* 通知 bio 处理结束 */
+out:
+	if (stat)
+		generic_end_io_acct(rw, &ramdisk.gendisk->part0, start_time);
+	ramdisk_lat_account(op, start);
+	bio_endio(bio,err);  /* 通知 bio 处理结束 */
 	/* bvoid bio_endio(struct bio *bio, int error) */
 }
 
@@ -125,17 +1493,32 @@ static int __init ramdisk_init(void)
 	int ret=0;
 	printk("ramdisk init\r\n");
 
-	/* 1、申请用于ramdisk内存 */
-	ramdisk.ramdiskbuf=kzalloc(RAMDISK_SIZE,GFP_KERNEL);    /* 正常分配内存 */
-	if(ramdisk.ramdiskbuf==NULL){
+	/* 1、初始化ramdisk内存空间，页在第一次写的时候才分配 */
+	ret = ramdisk_check_queue_params();
+	if (ret)
+		goto ram_fail;
+	ramdisk.capacity = (sector_t)ramdisk_size * 2;    /* KB转换为扇区数 */
+	ramdisk.capacity = round_down(ramdisk.capacity, logical_block_size >> 9);   /* 容量为逻辑块大小的整数倍 */
+	if (ramdisk.capacity == 0) {
+		printk("ramdisk: size %luKB is smaller than one block\r\n", ramdisk_size);
 		ret = -EINVAL;
 		goto ram_fail;
 	}
+	INIT_RADIX_TREE(&ramdisk.pages, GFP_ATOMIC);
+	if (compress) {
+		dax = false;	/* 压缩后的数据不能直接映射 */
+		ret = ramdisk_zinit();
+		if (ret)
+			goto ram_fail;
+	}
+	if (!dax)
+		ramdisk_fops.direct_access = NULL;
 
 	/* 2、注册块设备 */
 	ramdisk.major=register_blkdev(0,RAMDISK_NAME);
 	/* int register_blkdev(unsigned int major, const char *name),由系统自动分配主设备号，那么返回值就是系统分配的主设备号(1~255)，如果返回负值那就表示注册失败 */
 	if(ramdisk.major<0){
+		ret = ramdisk.major;
 		goto register_blkdev_fail;
 	}
 
@@ -162,6 +1545,19 @@ static int __init ramdisk_init(void)
 	blk_queue_make_request(ramdisk.queue,ramdisk_make_request_fn);
 	/* void blk_queue_make_request(struct request_queue *q, make_request_fn *mfn) */
 
+	ramdisk_set_queue_limits(ramdisk.queue);
+
+	/* 支持discard，fstrim和mkfs -E discard可以把不用的页还给系统。
+	 * discard之后读到的数据为0，所以blkdev_issue_zeroout也会直接使用discard
+	 */
+	ramdisk.queue->limits.discard_granularity = PAGE_SIZE;
+	blk_queue_max_discard_sectors(ramdisk.queue, UINT_MAX);
+	ramdisk.queue->limits.discard_zeroes_data = 1;
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, ramdisk.queue);
+
+	/* 开启I/O统计，可以通过/sys/block/ramdisk/queue/iostats关闭 */
+	queue_flag_set_unlocked(QUEUE_FLAG_IO_STAT, ramdisk.queue);
+
 	/* 6、初始化gendisk 参考(drivers/block/zram/zram_drv.c)*/
 	ramdisk.gendisk->major=ramdisk.major;  /* 主设备号 */
 	ramdisk.gendisk->first_minor=0;    /* 第一个次设备号(起始次设备号) */
@@ -172,13 +1568,40 @@ static int __init ramdisk_init(void)
 	//ramdisk.gendisk->disk_name=RAMDISK_NAME;      /* 名字 */
 	sprintf(ramdisk.gendisk->disk_name, RAMDISK_NAME);   /* 名字，给字符数组类型赋值 */
 
-	set_capacity(ramdisk.gendisk,RAMDISK_SIZE/512);  /* 设备容量(单位为扇区) */
+	set_capacity(ramdisk.gendisk,ramdisk.capacity);  /* 设备容量(单位为扇区) */
 	/* void set_capacity(struct gendisk *disk, sector_t size)-设置 gendisk 容量 ,扇区数量(1个扇区512字节)*/
 
+	/* 从快照恢复数据，在磁盘对外可见之前完成 */
+	if (restore && *restore) {
+		ret = ramdisk_restore(restore);
+		if (ret == -ENOENT) {
+			ret = 0;	/* 第一次使用还没有快照文件 */
+		} else if (ret) {
+			blk_cleanup_queue(ramdisk.queue);
+			goto blk_init_fail;
+		}
+	}
+
 	/* 7、将gendisk添加内核 */
 	add_disk(ramdisk.gendisk);
 	/* void add_disk(struct gendisk *disk)-将 gendisk 添加到内核 */
 
+	/* 8、在debugfs中创建延迟直方图，/sys/kernel/debug/ramdisk/latency */
+	ramdisk.debugfs = debugfs_create_dir(RAMDISK_NAME, NULL);
+	if (!IS_ERR_OR_NULL(ramdisk.debugfs))
+		debugfs_create_file("latency", 0644, ramdisk.debugfs, NULL, &ramdisk_lat_fops);
+
+	/* 9、创建快照的sysfs文件 */
+	if (device_create_file(disk_to_dev(ramdisk.gendisk), &dev_attr_snapshot))
+		printk("ramdisk: create snapshot file failed\r\n");
+
+	/* 10、压缩模式下创建统计信息的sysfs文件 */
+	if (compress) {
+		ret = sysfs_create_group(&disk_to_dev(ramdisk.gendisk)->kobj, &ramdisk_zattr_group);
+		if (ret)
+			printk("ramdisk: create sysfs group failed\r\n");
+	}
+
 	return 0;
 
 blk_init_fail:
@@ -187,7 +1610,9 @@ blk_init_fail:
 gendisk_alloc_fail:
 	unregister_blkdev(ramdisk.major,RAMDISK_NAME);
 register_blkdev_fail:
-	kfree(ramdisk.ramdiskbuf);  /* 释放内存 */
+	ramdisk_free_pages();
+	if (compress)
+		ramdisk_zexit();
 ram_fail:
 	return ret;
 }
@@ -201,6 +1626,12 @@ static void __exit ramdisk_exit(void)
 {
 	printk("ramdisk exit!\r\n");
 
+	debugfs_remove_recursive(ramdisk.debugfs);
+	device_remove_file(disk_to_dev(ramdisk.gendisk), &dev_attr_snapshot);
+
+	if (compress)
+		sysfs_remove_group(&disk_to_dev(ramdisk.gendisk)->kobj, &ramdisk_zattr_group);
+
 	/* 删除gendisk */
 	del_gendisk(ramdisk.gendisk);
 	put_disk(ramdisk.gendisk);   /* 参考 */
@@ -211,8 +1642,11 @@ static void __exit ramdisk_exit(void)
 	/* 注销块设备 */
 	unregister_blkdev(ramdisk.major,RAMDISK_NAME);
 
-	/* 释放内存 */
-	kfree(ramdisk.ramdiskbuf);
+	/* 释放内存，等待discard延迟释放的页全部完成后模块才能卸载 */
+	ramdisk_free_pages();
+	rcu_barrier();
+	if (compress)
+		ramdisk_zexit();
 }
 
 /* 注册驱动加载和卸载 */
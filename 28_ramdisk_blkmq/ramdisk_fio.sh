@@ -0,0 +1,76 @@
+#!/bin/sh
+# 在开发板上运行，依次加载三个ramdisk驱动，用fio在同样大小的磁盘上测试并生成对比报告
+# 用法: ./ramdisk_fio.sh [运行时间(秒)] [磁盘容量(KB)] [结果目录]
+# 三个驱动注册的磁盘名都是ramdisk，所以一次只能加载一个
+# 测试矩阵: 顺序/随机读写 x 块大小(4k~1m) x 并发任务数(1~16)
+
+RUNTIME=${1:-5}
+SIZE_KB=${2:-65536}
+OUTDIR=${3:-./ramdisk_fio_result}
+DEV=/dev/ramdisk
+MODULES="ramdisk_request ramdisk_norequest ramdisk_mq"
+RWS="read write randread randwrite"
+BSS="4k 64k 1m"
+JOBS="1 4 16"
+CSV=$OUTDIR/result.csv
+
+mkdir -p $OUTDIR
+echo "module,rw,bs,jobs,bw_kbs,iops,clat_us" > $CSV
+
+# fio的terse输出第7、8、16列为读带宽(KB/s)、IOPS和平均完成延迟(us)，
+# 第48、49、57列为写带宽、IOPS和平均完成延迟
+run_fio()
+{
+	fio --name=$1 --filename=$DEV --rw=$2 --bs=$3 --numjobs=$4 --direct=1 \
+		--ioengine=libaio --iodepth=16 --group_reporting \
+		--time_based --runtime=$RUNTIME --minimal | \
+		awk -F';' -v mod=$1 -v rw=$2 -v bs=$3 -v jobs=$4 '{
+			if (rw ~ /read/)
+				printf "%s,%s,%s,%s,%d,%d,%.1f\n", mod, rw, bs, jobs, $7, $8, $16
+			else
+				printf "%s,%s,%s,%s,%d,%d,%.1f\n", mod, rw, bs, jobs, $48, $49, $57
+		}' >> $CSV
+}
+
+for mod in $MODULES; do
+	modprobe $mod ramdisk_size=$SIZE_KB || continue
+	sleep 1
+	echo "==== $mod ===="
+	for rw in $RWS; do
+		for bs in $BSS; do
+			for jobs in $JOBS; do
+				echo "$mod $rw $bs $jobs"
+				run_fio $mod $rw $bs $jobs
+			done
+		done
+	done
+
+	# 保存驱动自己的统计信息
+	cat /sys/block/ramdisk/stat > $OUTDIR/$mod.stat
+	[ -f /sys/kernel/debug/ramdisk/latency ] && \
+		cat /sys/kernel/debug/ramdisk/latency > $OUTDIR/$mod.latency
+	rmmod $mod
+done
+
+# 生成对比报告，每一行为一个测试项，每一列为一个驱动的IOPS和平均延迟
+awk -F',' -v mods="$MODULES" '
+	NR == 1 { next }
+	{
+		key = $2 " " $3 " " $4
+		if (!(key in seen)) { seen[key] = 1; order[++n] = key }
+		iops[key, $1] = $6
+		clat[key, $1] = $7
+	}
+	END {
+		m = split(mods, mod, " ")
+		printf "%-22s", "rw bs jobs"
+		for (i = 1; i <= m; i++)
+			printf " %24s", mod[i]
+		printf "\n"
+		for (k = 1; k <= n; k++) {
+			printf "%-22s", order[k]
+			for (i = 1; i <= m; i++)
+				printf " %12s IOPS %6sus", iops[order[k], mod[i]], clat[order[k], mod[i]]
+			printf "\n"
+		}
+	}' $CSV | tee $OUTDIR/report.txt
@@ -0,0 +1,442 @@
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/genhd.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/hdreg.h>
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+
+#define RAMDISK_NAME 	"ramdisk"    /* 名字 */
+#define RADMISK_MINOR	3					/* 表示有三个磁盘分区！不是次设备号为3！ */
+#define RAMDISK_SIZE	(2 * 1024 * 1024) 	/* 默认容量大小为2MB */
+#define PAGE_SECTORS_SHIFT	(PAGE_SHIFT - 9)		/* 一页对应的扇区数的位数 */
+#define PAGE_SECTORS		(1 << PAGE_SECTORS_SHIFT)	/* 一页对应的扇区数 */
+#define FREE_BATCH			16			/* 卸载时一次从radix树中取出的页数 */
+
+/* 容量大小，单位KB，只有写过的页才分配内存，所以可以比内存大 */
+static unsigned long ramdisk_size = RAMDISK_SIZE / 1024;
+module_param(ramdisk_size, ulong, 0444);
+MODULE_PARM_DESC(ramdisk_size, "Size of the ramdisk in kbytes");
+
+/* 硬件队列数量，0表示每个CPU一个硬件队列 */
+static int hw_queues = 0;
+module_param(hw_queues, int, 0444);
+MODULE_PARM_DESC(hw_queues, "Number of hardware queues (0 = one per CPU)");
+
+/* 每个硬件队列的深度 */
+static int queue_depth = 64;
+module_param(queue_depth, int, 0444);
+MODULE_PARM_DESC(queue_depth, "Queue depth of each hardware queue");
+
+/* ramdisk设备结构体 */
+struct ramdisk_dev{
+	int major;      /* 主设备号 */
+	struct gendisk *gendisk;  /* gendisk */
+	struct request_queue *queue;   /* 请求队列 */
+	struct blk_mq_tag_set tag_set;  /* blk-mq的tag集合，描述硬件队列数量和深度 */
+	spinlock_t pages_lock;   /* 只在修改pages时使用，查找使用RCU，多个硬件队列可以并行查找 */
+	struct radix_tree_root pages;   /* ramdisk内存空间，以页号为索引保存写过的页，参考brd.c(drivers/block/brd.c) */
+	unsigned long size;   /* ramdisk容量，单位为字节 */
+};
+
+struct ramdisk_dev ramdisk;
+
+/*
+ * @description		: 打开块设备
+ * @param - dev 	: 块设备
+ * @param - mode 	: 打开模式
+ * @return 			: 0 成功;其他 失败
+ */
+static int ramdisk_open (struct block_device *dev, fmode_t mode)
+{
+	printk("ramdisk open\r\n");
+	return 0;
+}
+
+/*
+ * @description		: 释放块设备
+ * @param - disk 	: gendisk
+ * @param - mode 	: 模式
+ * @return 			: 0 成功;其他 失败
+ */
+static void ramdisk_release (struct gendisk *gendisk, fmode_t mode)
+{
+	printk("ramdisk release\r\n");
+}
+
+/*
+ * @description		: 获取磁盘信息    存储容量=磁头x柱面x扇区x每扇区字节数(512)
+ * @param - dev 	: 块设备
+ * @param - geo 	: 模式
+ * @return 			: 0 成功;其他 失败
+ */
+static int ramdisk_getgeo (struct block_device *dev, struct hd_geometry *geo)
+{
+	/* 这是相对于机械硬盘的概念 */
+	geo->heads = 4;			/* 磁头 */
+	geo->sectors = 16;		/* 一个磁道上的扇区数量 */
+	geo->cylinders = min_t(unsigned long, ramdisk.size / (4 * 16 * 512), 0xffff);	/* 柱面 */
+	return 0;
+}
+
+/*
+ * 块设备操作函数
+ */
+static struct block_device_operations ramdisk_fops=
+{
+	.owner=THIS_MODULE,
+	.open=ramdisk_open,
+	.release=ramdisk_release,
+	.getgeo=ramdisk_getgeo,
+};
+
+/*
+ * @description	: 查找扇区所在的页，查找不需要加锁。
+ *				  返回的页只有在调用者处于RCU读临界区内时才能安全访问
+ * @param-sector: 扇区地址
+ * @return 		: 找到的页，没有分配过的话返回NULL
+ */
+static struct page *ramdisk_lookup_page(sector_t sector)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;	/* 页号 */
+	struct page *page;
+
+	rcu_read_lock();
+	page = radix_tree_lookup(&ramdisk.pages, idx);
+	rcu_read_unlock();
+
+	return page;
+}
+
+/*
+ * @description	: 查找扇区所在的页，没有的话就分配一个清零的页并插入radix树。
+ *				  和25_ramdisk_norequest不同，这里在请求处理函数中调用，不能睡眠，
+ *				  所以使用GFP_ATOMIC分配，radix树的节点也由GFP_ATOMIC分配，不需要预加载
+ * @param-sector: 扇区地址
+ * @return 		: 页，内存不足时返回NULL
+ */
+static struct page *ramdisk_insert_page(sector_t sector)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	struct page *page;
+
+	page = ramdisk_lookup_page(sector);
+	if (page)
+		return page;
+
+	/* 数据都通过kmap_atomic访问，所以页可以分配在高端内存 */
+	page = alloc_page(GFP_ATOMIC | __GFP_NOWARN | __GFP_ZERO | __GFP_HIGHMEM);
+	if (!page)
+		return NULL;
+
+	/* 插入时才加锁，两个上下文同时分配同一页的话，后插入的使用已有的页 */
+	spin_lock(&ramdisk.pages_lock);
+	page->index = idx;
+	if (radix_tree_insert(&ramdisk.pages, idx, page)) {
+		__free_page(page);
+		page = radix_tree_lookup(&ramdisk.pages, idx);
+	}
+	spin_unlock(&ramdisk.pages_lock);
+
+	return page;
+}
+
+/*
+ * @description	: 释放所有已分配的页
+ * @param 		: 无
+ * @return 		: 无
+ */
+static void ramdisk_free_pages(void)
+{
+	unsigned long pos = 0;
+	struct page *pages[FREE_BATCH];
+	int nr_pages, i;
+
+	do {
+		nr_pages = radix_tree_gang_lookup(&ramdisk.pages, (void **)pages, pos, FREE_BATCH);
+		for (i = 0; i < nr_pages; i++) {
+			pos = pages[i]->index;
+			radix_tree_delete(&ramdisk.pages, pos);
+			__free_page(pages[i]);
+		}
+		pos++;
+	} while (nr_pages == FREE_BATCH);
+}
+
+/*
+ * @description	: 写数据之前先分配好要用到的页，一个段最多跨越两个页
+ * @param-sector: 扇区地址
+ * @param-n 	: 数据长度
+ * @return 		: 0 成功;其他 失败
+ */
+static int copy_to_ramdisk_setup(sector_t sector, size_t n)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << 9;	/* 页内偏移 */
+	size_t copy = min_t(size_t, n, PAGE_SIZE - offset);
+
+	if (!ramdisk_insert_page(sector))
+		return -ENOMEM;
+	if (copy < n) {		/* 数据跨越两个页 */
+		sector += copy >> 9;
+		if (!ramdisk_insert_page(sector))
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * @description	: 在RCU读临界区内拷贝一页之内的数据，拷贝期间页不会被释放
+ * @param-buf 	: 读的时候为目的地址，写的时候为源地址
+ * @param-sector: 扇区地址
+ * @param-n 	: 数据长度，不能跨页
+ * @param-rw 	: 读或者写
+ * @return 		: 0 成功;-EAGAIN 写的时候页已经被discard释放
+ */
+static int ramdisk_copy_chunk(void *buf, sector_t sector, size_t n, int rw)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << 9;	/* 页内偏移 */
+	struct page *page;
+	void *mem;
+	int err = 0;
+
+	rcu_read_lock();
+	page = radix_tree_lookup(&ramdisk.pages, sector >> PAGE_SECTORS_SHIFT);
+	if (page) {
+		mem = kmap_atomic(page);
+		if (rw == READ)
+			memcpy(buf, mem + offset, n);
+		else
+			memcpy(mem + offset, buf, n);
+		kunmap_atomic(mem);
+	} else if (rw == READ) {
+		memset(buf, 0, n);		/* 没有写过的页读出来为0 */
+	} else {
+		err = -EAGAIN;
+	}
+	rcu_read_unlock();
+
+	return err;
+}
+
+/*
+ * @description	: 在ramdisk和bio的一个段之间拷贝数据，数据可能跨越两个页
+ * @param-buf 	: 段的内核地址
+ * @param-sector: 扇区地址
+ * @param-n 	: 数据长度
+ * @param-rw 	: 读或者写
+ * @return 		: 0 成功;-EAGAIN 写的时候页被同时进行的discard释放了，需要重新分配
+ */
+static int ramdisk_copy(void *buf, sector_t sector, size_t n, int rw)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << 9;	/* 页内偏移 */
+	size_t copy = min_t(size_t, n, PAGE_SIZE - offset);
+	int err;
+
+	err = ramdisk_copy_chunk(buf, sector, copy, rw);
+	if (err || copy == n)
+		return err;
+
+	/* 剩下的数据在下一页 */
+	return ramdisk_copy_chunk(buf + copy, sector + (copy >> 9), n - copy, rw);
+}
+
+/*
+ * @description	: 处理一个段，读没有写过的页直接返回0，写的时候才分配页
+ * @param-bvec 	: 段
+ * @param-sector: 扇区地址
+ * @param-rw 	: 读或者写
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_do_bvec(struct bio_vec *bvec, sector_t sector, int rw)
+{
+	void *buffer;
+	int err;
+
+	do {
+		if (rw != READ) {
+			err = copy_to_ramdisk_setup(sector, bvec->bv_len);
+			if (err)
+				return err;
+		}
+		buffer = kmap_atomic(bvec->bv_page);	/* 页可能位于高端内存，需要临时映射 */
+		err = ramdisk_copy(buffer + bvec->bv_offset, sector, bvec->bv_len, rw);
+		kunmap_atomic(buffer);
+	} while (err == -EAGAIN);	/* 和discard并发时页可能刚被释放，重新分配后再写 */
+
+	return err;
+}
+
+/*
+ * @description	: 处理一个完整的请求，遍历请求中所有bio的所有段
+ * @param-req 	: 请求
+ * @return 		: 0 成功;其他 失败
+ */
+static int ramdisk_transfer(struct request *req)
+{
+	sector_t sector = blk_rq_pos(req);  	/* 扇区地址 */
+	struct req_iterator iter;
+	struct bio_vec bvec;
+	int err;
+
+	if ((sector << 9) + blk_rq_bytes(req) > ramdisk.size)	/* 越界检查 */
+		return -EIO;
+
+	rq_for_each_segment(bvec, req, iter) {   /* 遍历请求中的所有段 */
+		err = ramdisk_do_bvec(&bvec, sector, rq_data_dir(req));
+		if (err)
+			return err;
+		sector += bvec.bv_len >> 9;
+	}
+	return 0;
+}
+
+/*
+ * @description	: blk-mq请求处理函数，每个硬件队列独立调用，不需要队列锁，
+ *				  所以多个CPU上的I/O可以并行处理
+ * @param-hctx 	: 硬件队列
+ * @param-bd 	: 要处理的请求
+ * @return 		: BLK_MQ_RQ_QUEUE_OK
+ */
+static int ramdisk_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+	struct request *req = bd->rq;
+	int err;
+
+	blk_mq_start_request(req);   /* 开始处理请求 */
+
+	if (req->cmd_type != REQ_TYPE_FS)
+		err = -EIO;
+	else
+		err = ramdisk_transfer(req);
+
+	blk_mq_end_request(req, err);   /* 完成整个请求 */
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+/*
+ * blk-mq操作函数
+ */
+static struct blk_mq_ops ramdisk_mq_ops = {
+	.queue_rq = ramdisk_queue_rq,
+	.map_queue = blk_mq_map_queue,   /* 软件队列到硬件队列的默认映射 */
+};
+
+/*
+ * @description	: 驱动模块加载函数
+ * @param 		: 无
+ * @return 		: 无
+ */
+static int __init ramdisk_init(void)
+{
+	int ret=0;
+	printk("ramdisk init\r\n");
+
+	/* 1、初始化ramdisk内存，数据保存在radix树的页中 */
+	ramdisk.size = ramdisk_size * 1024;
+	spin_lock_init(&ramdisk.pages_lock);
+	INIT_RADIX_TREE(&ramdisk.pages, GFP_ATOMIC);   /* 页在第一次写的时候才分配 */
+
+	/* 2、注册块设备 */
+	ramdisk.major=register_blkdev(0,RAMDISK_NAME);
+	if(ramdisk.major<0){
+		ret = ramdisk.major;
+		goto register_blkdev_fail;
+	}
+	printk("ramdisk major = %d\r\n", ramdisk.major);
+
+	/* 3、申请gendisk */
+	ramdisk.gendisk=alloc_disk(RADMISK_MINOR);
+	if(!ramdisk.gendisk){
+		ret=-ENOMEM;
+		goto gendisk_alloc_fail;
+	}
+
+	/* 4、初始化tag集合，参考null_blk(drivers/block/null_blk.c) */
+	if (hw_queues <= 0 || hw_queues > nr_cpu_ids)
+		hw_queues = nr_cpu_ids;
+	if (queue_depth <= 0)
+		queue_depth = 64;
+	ramdisk.tag_set.ops = &ramdisk_mq_ops;
+	ramdisk.tag_set.nr_hw_queues = hw_queues;     /* 硬件队列数量 */
+	ramdisk.tag_set.queue_depth = queue_depth;    /* 每个硬件队列的深度 */
+	ramdisk.tag_set.numa_node = NUMA_NO_NODE;
+	ramdisk.tag_set.cmd_size = 0;
+	ramdisk.tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+	ramdisk.tag_set.driver_data = &ramdisk;
+
+	ret = blk_mq_alloc_tag_set(&ramdisk.tag_set);
+	if (ret)
+		goto tag_set_fail;
+
+	/* 5、初始化blk-mq请求队列 */
+	ramdisk.queue = blk_mq_init_queue(&ramdisk.tag_set);
+	if (IS_ERR(ramdisk.queue)) {
+		ret = PTR_ERR(ramdisk.queue);
+		goto blk_init_fail;
+	}
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, ramdisk.queue);   /* 非旋转设备 */
+	printk("ramdisk hw_queues = %d, queue_depth = %d\r\n", hw_queues, queue_depth);
+
+	/* 6、初始化gendisk */
+	ramdisk.gendisk->major=ramdisk.major;  /* 主设备号 */
+	ramdisk.gendisk->first_minor=0;    /* 第一个次设备号(起始次设备号) */
+	ramdisk.gendisk->fops=&ramdisk_fops;   /* 操作函数 */
+	ramdisk.gendisk->private_data=&ramdisk;   /* 私有数据 */
+	ramdisk.gendisk->queue=ramdisk.queue;  /* 请求队列 */
+	sprintf(ramdisk.gendisk->disk_name, RAMDISK_NAME);   /* 名字，给字符数组类型赋值 */
+	set_capacity(ramdisk.gendisk,ramdisk.size/512);  /* 设备容量(单位为扇区) */
+
+	/* 7、将gendisk添加内核 */
+	add_disk(ramdisk.gendisk);
+
+	return 0;
+
+blk_init_fail:
+	blk_mq_free_tag_set(&ramdisk.tag_set);
+tag_set_fail:
+	put_disk(ramdisk.gendisk);   /* put_disk 是减少 gendisk 的引用计数 */
+gendisk_alloc_fail:
+	unregister_blkdev(ramdisk.major,RAMDISK_NAME);
+register_blkdev_fail:
+	return ret;
+}
+
+/*
+ * @description	: 驱动模块卸载函数
+ * @param 		: 无
+ * @return 		: 无
+ */
+static void __exit ramdisk_exit(void)
+{
+	printk("ramdisk exit!\r\n");
+
+	/* 删除gendisk */
+	del_gendisk(ramdisk.gendisk);
+	put_disk(ramdisk.gendisk);
+
+	/* 删除请求队列，释放tag集合 */
+	blk_cleanup_queue(ramdisk.queue);
+	blk_mq_free_tag_set(&ramdisk.tag_set);
+
+	/* 注销块设备 */
+	unregister_blkdev(ramdisk.major,RAMDISK_NAME);
+
+	/* 释放内存 */
+	ramdisk_free_pages();
+}
+
+/* 注册驱动加载和卸载 */
+module_init(ramdisk_init);
+module_exit(ramdisk_exit);
+
+/* LICENSE和作者信息 */
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("CVVO");
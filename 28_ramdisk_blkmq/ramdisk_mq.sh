@@ -0,0 +1,4 @@
+#!/bin/bash
+make clean
+make
+sudo cp ramdisk_mq.ko ramdisk_fio.sh  /home/cvvo/linux/nfs/rootfs/lib/modules/4.1.15/ -f
@@ -4,6 +4,10 @@
 #include <linux/ide.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
 
 #define LED_MAJOR  200
 #define LED_NAME  "led"
@@ -11,6 +15,29 @@
 #define LEDOFF 	0				/* 关灯，定义为字符串 */
 #define LEDON 	1				/* 开灯 */
 
+/* 驱动控制的GPIO1引脚，GPIO1_IO03为LED，作为指示灯的其他GPIO1引脚需要在设备树中复用为GPIO后加到这里 */
+#define LED_PINS		(1 << 3)
+#define LED_FRAME_MAX	64		/* 一次ioctl最多输出的帧数 */
+#define LED_DELAY_MAX_US	1000000	/* 每帧最长保持1s */
+
+/* 一帧：mask中为1的引脚输出value中对应位的电平(直接对应DR，LED低电平点亮)，然后保持delay_us微秒 */
+struct led_frame {
+	uint32_t mask;
+	uint32_t value;
+	uint32_t delay_us;
+};
+
+/* 帧序列 */
+struct led_frames {
+	uint32_t count;				/* 帧数，最多LED_FRAME_MAX */
+	uint32_t done;				/* 返回：全部输出完成时等于count，被信号打断时为停下的帧号 */
+	struct led_frame *frames;	/* 用户空间的帧数组 */
+};
+
+#define LED_SET_CMD		(_IOW(0XEF, 0x10, struct led_frame))	/* 输出一帧，忽略delay_us */
+#define LED_FRAMES_CMD	(_IOWR(0XEF, 0x11, struct led_frames))	/* 按顺序输出多帧 */
+#define LED_GET_CMD		(_IOR(0XEF, 0x12, uint32_t))			/* 读回GPIO1_DR */
+
 /* 寄存器物理地址 */
 #define CCM_CCGR1_BASE            (0X020C406C)
 #define SW_MUX_GPIO1_IO03_BASE    (0X020E0068)
@@ -25,6 +52,27 @@ static void __iomem *SW_PAD_GPIO1_IO03;
 static void __iomem *GPIO1_DR;
 static void __iomem *GPIO1_GDIR;
 
+/* GPIO1的其他引脚可能由gpio-mxc驱动控制，修改DR时需要读改写，锁保证本驱动的多个写者不会互相覆盖 */
+static DEFINE_SPINLOCK(gpio1_dr_lock);
+
+/*
+ * @description		: 一次性修改多个引脚的电平，读出GPIO1_DR，只修改mask中的位后写回
+ * @param - mask 	: 要修改的引脚
+ * @param - value 	: 引脚的新电平
+ * @return 			: 无
+ */
+static void led_update(uint32_t mask, uint32_t value)
+{
+	unsigned long flags;
+	uint32_t val;
+
+	spin_lock_irqsave(&gpio1_dr_lock, flags);
+	val = readl(GPIO1_DR);
+	val = (val & ~mask) | (value & mask);
+	writel(val, GPIO1_DR);
+	spin_unlock_irqrestore(&gpio1_dr_lock, flags);
+}
+
 /*
  * @description		: LED打开/关闭
  * @param - sta 	: LEDON(0) 打开LED，LEDOFF(1) 关闭LED
@@ -32,16 +80,10 @@ static void __iomem *GPIO1_GDIR;
  */
 void led_switch(uint8_t sta)
 {
-	uint32_t val;
 	if (sta==LEDON){
-		val=readl(GPIO1_DR);
-		val &=~(1<<3);
-		writel(val,GPIO1_DR);    /* 打开led */
+		led_update(1<<3, 0);       /* 打开led */
 	}else if(sta==LEDOFF){
-		val=readl(GPIO1_DR);
-		val &=~(1<<3);
-		val |=(1<<3);
-		writel(val,GPIO1_DR);    /* 关闭led */
+		led_update(1<<3, 1<<3);    /* 关闭led */
 	}
 
 }
@@ -86,7 +128,7 @@ static ssize_t led_write(struct file *filp, const char __user *buf, size_t cnt,
 	uint8_t databuf[1];
 	uint8_t ledstate;
 
-	ret=copy_from_user(databuf,buf,cnt);
+	ret=copy_from_user(databuf,buf,sizeof(databuf));   /* 只取第一个字节 */
 	if (ret<0){
 		printk("kernel write failed!\r\n");
 		return -EFAULT;
@@ -103,6 +145,94 @@ static ssize_t led_write(struct file *filp, const char __user *buf, size_t cnt,
 	return 0;
 }
 
+/*
+ * @description		: 帧之间的延时，短延时忙等，长延时可中断睡眠
+ * @param - us 	: 延时时间，单位us，最大LED_DELAY_MAX_US
+ * @return 			: 0 延时完成;-EINTR 被信号打断
+ */
+static int led_delay(uint32_t us)
+{
+	ktime_t end;
+
+	if (us == 0)
+		return 0;
+	if (us < 10) {
+		udelay(us);
+		return 0;
+	}
+
+	/* 和usleep_range的精度一样，但是睡眠可以被信号打断 */
+	end = ktime_add_us(ktime_get(), us);
+	do {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (schedule_hrtimeout_range(&end, (us / 16 + 10) * NSEC_PER_USEC, HRTIMER_MODE_ABS) == 0)
+			return 0;
+	} while (!signal_pending(current));
+	return -EINTR;
+}
+
+/*
+ * @description		: ioctl函数，批量修改引脚和输出帧序列，一次系统调用代替多次write
+ * @param - filp 	: 要打开的设备文件(文件描述符)
+ * @param - cmd 	: 应用程序发送过来的命令
+ * @param - arg 	: 参数
+ * @return 			: 0 成功;其他 失败
+ */
+static long led_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct led_frame frame, *frames;
+	struct led_frames seq;
+	uint32_t i;
+	long ret = 0;
+
+	switch (cmd) {
+	case LED_SET_CMD:
+		if (copy_from_user(&frame, (void __user *)arg, sizeof(frame)))
+			return -EFAULT;
+		if (frame.mask & ~LED_PINS)		/* 不能修改不属于本驱动的引脚 */
+			return -EINVAL;
+		led_update(frame.mask, frame.value);
+		break;
+
+	case LED_FRAMES_CMD:
+		if (copy_from_user(&seq, (void __user *)arg, sizeof(seq)))
+			return -EFAULT;
+		if (seq.count == 0 || seq.count > LED_FRAME_MAX)
+			return -EINVAL;
+		/* 先把所有帧拷贝进来并检查，输出过程中不再访问用户空间 */
+		frames = memdup_user((void __user *)seq.frames, seq.count * sizeof(*frames));
+		if (IS_ERR(frames))
+			return PTR_ERR(frames);
+		for (i = 0; i < seq.count; i++) {
+			if ((frames[i].mask & ~LED_PINS) || frames[i].delay_us > LED_DELAY_MAX_US) {
+				ret = -EINVAL;
+				goto out;
+			}
+		}
+		for (i = 0; i < seq.count; i++) {
+			led_update(frames[i].mask, frames[i].value);
+			ret = led_delay(frames[i].delay_us);
+			if (ret)	/* 被信号打断，停在当前帧 */
+				break;
+		}
+		/* 告诉应用程序输出到了哪一帧 */
+		if (put_user(i, &((struct led_frames __user *)arg)->done) && !ret)
+			ret = -EFAULT;
+out:
+		kfree(frames);
+		break;
+
+	case LED_GET_CMD:
+		ret = put_user(readl(GPIO1_DR), (uint32_t __user *)arg);
+		break;
+
+	default:
+		ret = -ENOTTY;
+		break;
+	}
+	return ret;
+}
+
 static int led_release(struct inode *inode, struct file *filp)
 {
 	return 0;
@@ -114,6 +244,7 @@ static struct file_operations led_fop={
 	.open=led_open,
 	.read=led_read,
 	.write=led_write,
+	.unlocked_ioctl=led_ioctl,
 	.release=led_release,
 };
 
@@ -154,13 +285,10 @@ static int __init led_init(void)
 
 	/* 4、GPIO初始化 */
 	val=readl(GPIO1_GDIR);
-	val &=~(1<<3);
-	val |=(1<<3);
+	val |=LED_PINS;
 	writel(val,GPIO1_GDIR);  /*设置方向寄存器为输出模式*/
 
-	val=readl(GPIO1_DR);
-	val|=(1<<3);      /* 置1 */
-	writel(val,GPIO1_DR);    /* 默认关闭led */
+	led_update(1<<3, 1<<3);    /* 默认关闭led */
 
 
 	/* 5、注册字符设备 */
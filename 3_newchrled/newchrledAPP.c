@@ -5,9 +5,29 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
 
 #define LEDOFF 	0				/* 关灯，定义为字符串 */
 #define LEDON 	1				/* 开灯 */
+#define LEDBLINK	2				/* 用帧序列闪烁 */
+
+/* 和驱动中的定义一致 */
+struct led_frame {
+	uint32_t mask;
+	uint32_t value;
+	uint32_t delay_us;
+};
+
+struct led_frames {
+	uint32_t count;
+	uint32_t done;		/* 驱动返回输出到的帧号 */
+	struct led_frame *frames;
+};
+
+#define LED_SET_CMD		(_IOW(0XEF, 0x10, struct led_frame))	/* 输出一帧，忽略delay_us */
+#define LED_FRAMES_CMD	(_IOWR(0XEF, 0x11, struct led_frames))	/* 按顺序输出多帧 */
+#define LED_GET_CMD		(_IOR(0XEF, 0x12, uint32_t))			/* 读回GPIO1_DR */
 
 /* 字符设备应用开发 */
 /*
@@ -16,7 +36,8 @@
  * @param - argv[] 	: 具体参数
  * @return 			: 0 成功;其他 失败
  * 使用方法	 ：./ledtest /dev/led  0 关闭LED
-		     ./ledtest /dev/led  1 打开LED	
+		     ./ledtest /dev/led  1 打开LED
+		     ./ledtest /dev/led  2 一次ioctl闪烁5次，然后读回DR
   			 argv[2] 1:读文件
   			 argv[2] 2:写文件	
  */
@@ -43,6 +64,32 @@ int main(int argc, char *argv[])
 
     databuf[0]=atoi(argv[2]);   /* 要执行的操作：打开或关闭，将字符形式转换为数字格式 */
 
+    if(databuf[0]==LEDBLINK){
+        struct led_frame frame[10];
+        struct led_frames seq;
+        uint32_t dr;
+        int i;
+
+        /* 10帧交替亮灭，每帧保持100ms，只需要一次系统调用 */
+        for(i=0;i<10;i++){
+            frame[i].mask=1<<3;
+            frame[i].value=(i&1)?(1<<3):0;    /* 低电平点亮 */
+            frame[i].delay_us=100000;
+        }
+        seq.count=10;
+        seq.done=0;
+        seq.frames=frame;
+        ret=ioctl(fd,LED_FRAMES_CMD,&seq);
+        if(ret<0){
+            printf("LED Blink Failed at frame %u!\r\n",seq.done);
+        }
+        if(ioctl(fd,LED_GET_CMD,&dr)==0){
+            printf("GPIO1_DR=%#x\r\n",dr);
+        }
+        close(fd);
+        return ret<0 ? -1 : 0;
+    }
+
     ret=write(fd,databuf,sizeof(databuf));
     if(ret<0){
         printf("LED Control Failed!\r\n");